@@ -0,0 +1,457 @@
+/*
+ * Typc - A console-based typing trainer
+ * Copyright (C) 2025 Joshua Rose <joshuarose@gmx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Headless benchmark of the render and scoring hot paths, built and run by
+ * `make bench`.
+ *
+ * main.c is included directly so that its static functions can be called.
+ * Synthetic sessions are rendered into an ncurses screen whose output goes to
+ * a temporary file, which gives the bytes written to the terminal per
+ * keystroke. The makefile links with --wrap for malloc, calloc and realloc so
+ * that allocations made by typc itself (not by ncurses) can be counted.
+ */
+
+#define main typc_main
+#include "main.c"
+#undef main
+
+/* race.c is not linked in; nothing benchmarked here races. */
+int
+race_serve(const char* path, race_pick_fn* pick, void* ctx, int debug)
+{
+  (void)path;
+  (void)pick;
+  (void)ctx;
+  (void)debug;
+  return -1;
+}
+
+int
+race_connect(struct race_conn* rc, const char* path)
+{
+  (void)rc;
+  (void)path;
+  return -1;
+}
+
+int
+race_poll(struct race_conn* rc)
+{
+  (void)rc;
+  return -1;
+}
+
+void
+race_report(struct race_conn* rc,
+            uint32_t cur,
+            uint32_t errors,
+            double wpm,
+            int done)
+{
+  (void)rc;
+  (void)cur;
+  (void)errors;
+  (void)wpm;
+  (void)done;
+}
+
+/* Length of the synthetic text */
+#define BENCH_CHARS 4000
+
+/* Sessions per render mode */
+#define BENCH_SESSIONS 20
+
+/* One keystroke in BENCH_TYPO_RATE is a typo, fixed with a backspace */
+#define BENCH_TYPO_RATE 30
+
+/* Iterations of the scoring benchmarks */
+#define BENCH_ITERS 2000
+
+/* Startups timed by bench_startup */
+#define BENCH_STARTUPS 50
+
+void*
+__real_malloc(size_t size);
+void*
+__real_calloc(size_t nmemb, size_t size);
+void*
+__real_realloc(void* ptr, size_t size);
+
+/* Allocations made by typc since the last reset */
+static unsigned long allocs = 0;
+
+/* Time spent in render_frame itself, leaving out ncurses' refresh */
+static uint64_t render_ns = 0;
+
+void*
+__wrap_malloc(size_t size)
+{
+  allocs++;
+  return __real_malloc(size);
+}
+
+void*
+__wrap_calloc(size_t nmemb, size_t size)
+{
+  allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void*
+__wrap_realloc(void* ptr, size_t size)
+{
+  allocs++;
+  return __real_realloc(ptr, size);
+}
+
+/* Deterministic generator, so every run benches the same text and keys */
+static uint32_t bench_seed = 12345;
+
+static uint32_t
+bench_rand(void)
+{
+  bench_seed = bench_seed * 1103515245u + 12345u;
+  return bench_seed >> 16;
+}
+
+/* Fill text with BENCH_CHARS of words, normalised as corpus texts are. */
+static void
+bench_text(char* text)
+{
+  static const char* words[] = { "the",    "quick", "brown",   "fox",
+                                 "jumps",  "over",  "lazy",    "dog",
+                                 "typing", "keys",  "rhythm,", "speed.",
+                                 "a",      "of",    "and",     "terminal" };
+  size_t n = 0, len;
+  const char* w;
+
+  while (n < BENCH_CHARS) {
+    w = words[bench_rand() % (sizeof(words) / sizeof(*words))];
+    len = strlen(w);
+    if (n + len + 1 > BENCH_CHARS) {
+      break;
+    }
+    memcpy(text + n, w, len);
+    n += len;
+    text[n++] = ' ';
+  }
+  text[n] = '\0';
+}
+
+/* Colours of __init_ncurses that the benchmarks draw with. */
+static void
+bench_colors(void)
+{
+  (void)start_color();
+  (void)init_pair(1, COLOR_WHITE, COLOR_BLACK);
+  (void)init_pair(2, COLOR_WHITE, COLOR_BLACK);
+  (void)init_pair(3, COLOR_RED, COLOR_BLACK);
+  (void)init_pair(4, COLOR_GREEN, COLOR_BLACK);
+}
+
+/* Start a session on text the way run_typing_trainer does. */
+static void
+bench_begin(struct session_bufs* sb, const char* text, size_t chars)
+{
+  if (session_begin(sb, text, chars) != 0) {
+    perror("session_begin");
+    exit(EXIT_FAILURE);
+  }
+  sb->rs.full = 1;
+  sb->rs.width = 0;
+  sb->rs.offset = 0;
+  sb->rs.index = 0;
+  sb->rs.layout.width = 0;
+}
+
+/* Size of the screen's output file, i.e. bytes written so far. */
+static long
+bench_output(FILE* out)
+{
+  struct stat st;
+
+  (void)fflush(out);
+  return fstat(fileno(out), &st) == 0 ? (long)st.st_size : 0;
+}
+
+/**
+ * bench_session - Type a text through session_key, rendering every frame
+ * the way run_typing_trainer does.
+ * @sb: Buffers reused across sessions.
+ * @text: The text.
+ * @m: Its metrics.
+ *
+ * Returns the number of keystrokes.
+ */
+static size_t
+bench_session(struct session_bufs* sb,
+              const char* text,
+              const struct text_metrics* m)
+{
+  const struct glyph_table* g = &sb->glyphs;
+  int width = getmaxx(stdscr);
+  size_t keys = 0;
+  uint64_t start;
+  int ch;
+
+  bench_begin(sb, text, m->chars);
+  while (sb->cur < sb->total) {
+    start = now_ns();
+    render_frame(&sb->rs, g, width, sb->typed, (int)sb->cur);
+    render_ns += now_ns() - start;
+    (void)refresh();
+    keys++;
+
+    if (sb->cur > 0 && sb->typed[sb->cur - 1] == '#' &&
+        g->cp[sb->cur - 1] != '#') {
+      ch = RECORD_BACKSPACE;
+    } else if (bench_rand() % BENCH_TYPO_RATE == 0) {
+      ch = '#';
+    } else {
+      ch = (int)g->cp[sb->cur];
+    }
+    (void)session_key(sb, now_ns(), ch);
+  }
+  return keys;
+}
+
+/**
+ * bench_startup - Time what main does before the first frame.
+ * @out: Output file of the screens.
+ * @in: Input file of the screens.
+ *
+ * Each startup opens the installed corpus and chooses a text (startup_text),
+ * sets up a new screen and renders the first frame. main overlaps the first
+ * part with the second where there are two cores. The user's state files are
+ * left alone, so the state_open of startup_text is not timed. Nothing is
+ * timed if no text is installed.
+ */
+static void
+bench_startup(FILE* out, FILE* in)
+{
+  static struct session_bufs sb;
+  struct startup_job job;
+  struct text_choice choice;
+  struct corpus corpus;
+  struct arena arena;
+  uint64_t start, t, text_ns = 0, screen_ns = 0, frame_ns = 0;
+  SCREEN* scr;
+  int k;
+
+  memset(&arena, 0, sizeof(arena));
+  state_status = -1; /* state_open returns at once */
+  for (k = 0; k < BENCH_STARTUPS; k++) {
+    memset(&job, 0, sizeof(job));
+    job.corpus = &corpus;
+    job.arena = &arena;
+    job.choice = &choice;
+    start = now_ns();
+    startup_text(&job);
+    if (job.ret != 0) {
+      fprintf(stderr, "bench: no installed text, startup not timed\n");
+      break;
+    }
+    t = now_ns();
+    text_ns += t - start;
+    scr = newterm("xterm", out, in);
+    if (scr == NULL) {
+      fprintf(stderr, "bench: newterm failed\n");
+      exit(EXIT_FAILURE);
+    }
+    bench_colors();
+    screen_ns += now_ns() - t;
+    bench_begin(&sb, choice.text, choice.metrics.chars);
+    render_frame(&sb.rs, &sb.glyphs, getmaxx(stdscr), sb.typed, 0);
+    (void)refresh();
+    frame_ns += now_ns() - start;
+
+    (void)endwin();
+    delscreen(scr);
+    if (job.have_corpus) {
+      corpus_close(&corpus);
+    }
+    arena_reset(&arena);
+  }
+  if (k == BENCH_STARTUPS) {
+    printf("startup   %8.0f ns to first frame (%.0f corpus and text, "
+           "%.0f screen)\n",
+           (double)frame_ns / BENCH_STARTUPS,
+           (double)text_ns / BENCH_STARTUPS,
+           (double)screen_ns / BENCH_STARTUPS);
+  }
+  arena_free(&arena);
+  session_bufs_free(&sb);
+}
+
+static void
+bench_render(const char* label,
+             int wrap,
+             FILE* out,
+             const char* text,
+             const struct text_metrics* m)
+{
+  static struct session_bufs sb;
+  uint64_t start, ns = 0;
+  size_t keys = 0;
+  unsigned long first = 0, steady = 0;
+  long bytes;
+  int s;
+
+  render_frame = wrap ? render_wrapped : render_scrolled;
+  render_ns = 0;
+  bytes = bench_output(out);
+  for (s = 0; s < BENCH_SESSIONS; s++) {
+    allocs = 0;
+    start = now_ns();
+    keys += bench_session(&sb, text, m);
+    ns += now_ns() - start;
+    if (s == 0) {
+      first = allocs;
+    } else {
+      steady += allocs;
+    }
+  }
+  bytes = bench_output(out) - bytes;
+
+  printf("%-9s %8.0f ns/key (%5.0f rendering) %8.1f bytes/key "
+         "%4lu allocs first session, %.1f after\n",
+         label,
+         (double)ns / (double)keys,
+         (double)render_ns / (double)keys,
+         (double)bytes / (double)keys,
+         first,
+         (double)steady / (BENCH_SESSIONS - 1));
+  session_bufs_free(&sb);
+}
+
+static void
+bench_scoring(const char* text, const struct text_metrics* m)
+{
+  static struct session_bufs sb;
+  static uint64_t mask[(BENCH_CHARS + 63) / 64];
+  struct text_metrics mm;
+  uint64_t start;
+  double wpm, cpm, sink = 0.0;
+  size_t n = m->chars, nkeys, i;
+  struct key_event* keys;
+  int k;
+
+  start = now_ns();
+  for (k = 0; k < BENCH_ITERS; k++) {
+    text_metrics_init(&mm, text);
+    sink += mm.avg_word_len;
+  }
+  printf("text_metrics_init   %8.2f ns/char\n",
+         (double)(now_ns() - start) / ((double)BENCH_ITERS * n));
+
+  start = now_ns();
+  for (k = 0; k < BENCH_ITERS; k++) {
+    calc_speed(m, 60.0 + k, &wpm, &cpm);
+    sink += wpm;
+  }
+  printf("calc_speed          %8.2f ns/call\n",
+         (double)(now_ns() - start) / BENCH_ITERS);
+
+  /* Type a session with typos, then replay its keys without rendering. */
+  render_frame = render_scrolled;
+  (void)bench_session(&sb, text, m);
+  nkeys = sb.log.len;
+  keys = malloc(nkeys * sizeof(*keys));
+  if (!keys) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(keys, sb.log.ev, nkeys * sizeof(*keys));
+  start = now_ns();
+  for (k = 0; k < BENCH_ITERS / 10; k++) {
+    (void)session_begin(&sb, text, n);
+    for (i = 0; i < nkeys; i++) {
+      (void)session_key(&sb, keys[i].t_ns, keys[i].ch);
+    }
+    sink += (double)sb.correct;
+  }
+  printf("session_key         %8.2f ns/key\n",
+         (double)(now_ns() - start) / ((double)(BENCH_ITERS / 10) * nkeys));
+  free(keys);
+
+  start = now_ns();
+  for (k = 0; k < BENCH_ITERS; k++) {
+    mismatch_mask(sb.typed, sb.glyphs.cp, n, mask);
+    sink += (double)mask[k % (sizeof(mask) / sizeof(*mask))];
+  }
+  printf("mismatch_mask       %8.2f ns/char\n",
+         (double)(now_ns() - start) / ((double)BENCH_ITERS * n));
+
+  start = now_ns();
+  for (k = 0; k < BENCH_ITERS / 10; k++) {
+    latency_stats_compute(&sb.lat, &sb.log);
+    sink += sb.lat.consistency;
+  }
+  printf("latency_stats       %8.2f ns/key\n",
+         (double)(now_ns() - start) / ((double)(BENCH_ITERS / 10) * sb.log.len));
+
+  session_bufs_free(&sb);
+  if (sink == 0.0) {
+    printf("\n");
+  }
+}
+
+int
+main(void)
+{
+  static char text[BENCH_CHARS + 1];
+  struct text_metrics m;
+  SCREEN* scr;
+  FILE *out, *in;
+
+  bench_text(text);
+  text_metrics_init(&m, text);
+
+  /* A fixed 80x24 screen whose output is only measured. */
+  out = tmpfile();
+  in = fopen("/dev/null", "r");
+  if (!out || !in) {
+    perror("bench");
+    return 1;
+  }
+  (void)setenv("LINES", "24", 1);
+  (void)setenv("COLUMNS", "80", 1);
+  bench_startup(out, in);
+
+  scr = newterm("xterm", out, in);
+  if (scr == NULL) {
+    fprintf(stderr, "bench: newterm failed\n");
+    return 1;
+  }
+  bench_colors();
+
+  printf("%d chars, %d sessions per mode, 80x24 screen\n",
+         (int)m.chars,
+         BENCH_SESSIONS);
+  bench_render("scrolled", 0, out, text, &m);
+  bench_render("wrapped", 1, out, text, &m);
+
+  bench_scoring(text, &m);
+
+  (void)endwin();
+  delscreen(scr);
+  fclose(out);
+  fclose(in);
+  return 0;
+}
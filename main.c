@@ -16,22 +16,38 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define DEF_AVG_WORDLEN 5
 #define DT_REG 8
-#define ENTRIES_DIR "/usr/local/lib/typc/texts"
+#define LIB_DIR "/usr/local/lib/typc"
+#define ENTRIES_DIR LIB_DIR "/texts"
+#define CORPUS_FILE LIB_DIR "/texts.pack"
+#define INDEX_FILE LIB_DIR "/texts.idx"
 #define MAX_PATH_SIZE (PATH_MAX)
 #define REGULAR_FILE DT_REG
 
@@ -41,6 +57,12 @@
 /* maximal printable char */
 #define PRINT_CHAR_MAX 126
 
+/* Largest Unicode code point */
+#define CODE_POINT_MAX 0x10FFFF
+
+/* Function keys as returned by read_key, above every code point */
+#define KEY_FN(k) (CODE_POINT_MAX + 1 + (k))
+
 /**
  * Easier visual on error
  *
@@ -49,6 +71,102 @@
  */
 #define HIDE_ERR 1
 
+/* Inter-key latency histogram: 4 log buckets per octave from 1 ms up. */
+#define LAT_BUCKETS 64
+#define LAT_SUB_BITS 2
+#define LAT_MIN_SHIFT 10
+
+/* Number of distinct printable chars, i.e. one side of the bigram table */
+#define BIGRAM_CHARS (PRINT_CHAR_MAX - PRINT_CHAR_MIN + 1)
+
+/* Number of slowest bigrams reported after a test */
+#define SLOW_BIGRAMS 3
+
+/* Keystroke profile file format (see profile_open). A pause longer than
+ * KEY_STATS_MAX_US counts as that long, and --heatmap only ranks bigrams
+ * typed at least HEATMAP_MIN_SAMPLES times. */
+#define PROFILE_MAGIC "TYPCPROF"
+#define PROFILE_VERSION 1
+#define KEY_STATS_MAX_US 2000000u
+#define HEATMAP_MIN_SAMPLES 20
+
+/* Binary score store format (see score_store_open). */
+#define SCORE_MAGIC "TYPCSCOR"
+#define SCORE_FOOTER_MAGIC "TYPCFOOT"
+#define SCORE_VERSION 1
+#define SCORE_RECORD_TAG 0x53524543u
+#define SCORE_RECENT 20
+#define SCORE_TOP_BESTS 10
+
+/* Packed corpus file format (see build_corpus). */
+#define CORPUS_MAGIC "TYPCPACK"
+#define CORPUS_VERSION 7
+
+/* Preset dictionary of the packed corpus (see corpus_dict): at most the
+ * deflate window, made of segments scored by the d-mers they contain, which
+ * are counted in a table of 1 << CORPUS_DICT_HASH_BITS slots. */
+#define CORPUS_DICT_MAX 32768
+#define CORPUS_DICT_SEG 64
+#define CORPUS_DICT_DMER 6
+#define CORPUS_DICT_HASH_BITS 20
+
+/* Entry of a text that does not come from the corpus */
+#define CORPUS_NONE UINT32_MAX
+
+/* Per-text feature vectors used by --adaptive (see text_features): one
+ * dimension per letter, one for digits, one for other punctuation and
+ * FEAT_BIGRAM_BUCKETS hashed bigram buckets. */
+#define FEAT_DIMS 64
+#define FEAT_DIGIT 26
+#define FEAT_PUNCT 27
+#define FEAT_BIGRAM 28
+#define FEAT_BIGRAM_BUCKETS (FEAT_DIMS - FEAT_BIGRAM)
+/* Texts scored per adaptive pick, and the best of them drawn from */
+#define FEAT_CANDIDATES 256
+#define FEAT_TOP 8
+/* Scales error rates to be comparable with bigram slowdowns */
+#define FEAT_ERROR_WEIGHT 10.0f
+/* Tail of the scores CSV read to seed the weakness profile */
+#define FEAT_SEED_BYTES 16384
+
+/* Minimum time between two frames while keys are arriving */
+#define FRAME_NS (1000000000 / 60)
+
+/* Update interval of the live ticker while no keys arrive */
+#define TICKER_NS 250000000
+
+/* Rows at the bottom of the screen used by the live ticker */
+#define STATUS_ROWS 1
+
+/* Keys in the rolling window of the live ticker's current speed */
+#define ROLL_KEYS 40
+
+/* Spans kept by --trace; once full, the oldest are overwritten */
+#define TRACE_CAP 65536
+
+/* Text streams of --time and --words (see text_stream): the window size,
+ * the characters kept behind the cursor and the characters kept ahead of
+ * it before the window is refilled. */
+#define STREAM_CAP 4096
+#define STREAM_KEEP 1024
+#define STREAM_AHEAD 1024
+
+/* Alignment of arena allocations and size of the first block of an arena */
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK 65536
+
+/* Most threads used by run_workers */
+#define MAX_WORKERS 64
+
+/* Keystroke record file format (see record_session). */
+#define RECORD_MAGIC "TYPCREC"
+#define RECORD_VERSION 2
+#define RECORD_BACKSPACE (PRINT_CHAR_MAX + 1)
+
+/* Text name index file format (see select_random_file). */
+#define INDEX_MAGIC "TYPCIDX"
+#define INDEX_VERSION 1
+
 /* Splint doesn't exactly 'understand' certain ncurses functions as ncurses is
  * external. */
 #ifdef SPLINT
@@ -66,724 +184,6552 @@ init_pair(short, short, short);
 #include <ncurses.h>
 #endif
 
-/* select_random_file - Select a random file from a given directory.
+#include "race.h"
+
+/**
+ * corpus_header - On-disk header of the packed corpus.
+ *
+ * The file is laid out as the header, followed by `count` corpus_entry
+ * records starting at `index_off`, followed by a blob holding every entry name
+ * and text. Names are stored null-terminated so that they can be used in
+ * place from the mapping. Each text is a raw deflate stream of its own,
+ * compressed with the `dict_len` byte preset dictionary at `dict_off`, so
+ * that one text is inflated without touching the others. All integers are in
+ * host byte order; the corpus is built on the machine that uses it.
  *
- * @returns the selected file
+ * `src_mtime_*` record the modification time of the source directory when the
+ * corpus was built, so that a corpus made stale by added or removed texts is
+ * not used.
  *
+ * `feat_off` locates `count` feature vectors of FEAT_DIMS bytes each, in entry
+ * order, computed by text_features.
  */
-static char*
-select_random_file(void);
+struct corpus_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t index_off;
+  uint64_t size;
+  int64_t src_mtime_sec;
+  int64_t src_mtime_nsec;
+  uint64_t feat_off;
+  uint64_t dict_off;
+  uint64_t dict_len;
+};
 
 /**
- * parse_args - A function to parse arguments from argv.
+ * text_metrics - Counts derived from a text, computed once when it is loaded.
  *
- * @argv - The arguments themselves
- * @argc - Number of arguments
+ * @chars: Length of the text in characters, see utf8_glyph.
+ * @bytes: Length of the text in bytes.
+ * @non_space: Number of non-whitespace characters.
+ * @words: Number of whitespace-separated words.
+ * @lines: Number of lines, counting a final unterminated one.
+ * @longest_word: Length of the longest word.
+ * @avg_word_len: non_space / words, or DEF_AVG_WORDLEN for an empty text.
+ */
+struct text_metrics
+{
+  size_t chars;
+  size_t bytes;
+  size_t non_space;
+  size_t words;
+  size_t lines;
+  size_t longest_word;
+  double avg_word_len;
+};
+
+/**
+ * corpus_entry - One record of the packed corpus offset table.
  *
+ * Offsets are relative to the start of the file. Lengths exclude the null
+ * terminator; @text_len is that of the text once inflated and @text_zlen
+ * that of its deflate stream. The texts are normalised (see text_normalise)
+ * and @id is the content hash of each, from hash_text; no two entries have
+ * the same text. The remaining fields are the entry's text_metrics,
+ * precomputed by build_corpus.
  */
-static void
-parse_args(int argc, char** argv);
+struct corpus_entry
+{
+  uint32_t name_off;
+  uint32_t name_len;
+  uint32_t text_off;
+  uint32_t text_len;
+  uint32_t chars;
+  uint32_t non_space;
+  uint32_t words;
+  uint32_t lines;
+  uint32_t longest_word;
+  uint32_t text_zlen;
+  uint64_t id;
+};
 
 /**
- * @text - The text to draw
- * @total_chars - The total number of chars to draw.
- * @screen_width - The number of columns that can be used.
- * @typed - The characters that have already been typed.
- * @current_index - The current position of the cursor respective to
- * `total_chars`.
+ * index_header - On-disk header of the text name index.
  *
- * Draw wrapped text. I.e. show all the text that can be possibly shown within
- * the contraints of the width and height of the terminal display. This is with
- * the --wrap option. By default the --wrap option if not toggled on.
+ * Followed by `count` uint32_t offsets, each pointing at a null-terminated
+ * entry name further down the file. `mtime_*` hold the modification time of
+ * the directory the names were read from; the index is only trusted while it
+ * matches.
  */
-static void
-draw_wrapped(const char* text,
-             int total_chars,
-             int screen_width,
-             char* typed,
-             int current_index);
+struct index_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t size;
+};
 
 /**
- * @draw_scrolled - Draw scrolled text.
+ * glyph_table - Where the characters of a text are, computed once per round
+ * by glyphs_build.
  *
- * @text - The text to draw.
- * @total_chars - The total number of chars in the text
- * @i - The current index
- * @screen_width - self explainatory
- * @typed - chars already typed. Should be none.
- * @current_index - chars already typed. Should be none.
+ * Texts are UTF-8, while the cursor, the typed characters and the line-break
+ * table count characters (glyphs, see utf8_glyph). The table maps glyph i to
+ * its code point, its bytes [off[i], off[i + 1]) and its screen columns
+ * [col[i], col[i + 1]), so every conversion the renderer needs is one
+ * lookup.
  *
+ * @text: The text.
+ * @n: Number of glyphs.
+ * @cap: Glyphs the arrays have room for.
+ * @raw: Glyphs that are bytes of invalid UTF-8; each is read as the Latin-1
+ * character of its byte.
+ * @ascii: Every glyph is one byte of printable ASCII, as in every corpus text
+ * (see text_normalise), so draw_span can write its cells directly.
+ * @cp: Code point of each glyph, the character to type.
+ * @off: Byte offset of each glyph, plus the length of the text.
+ * @col: Column of each glyph from the start of the text, plus the width of
+ * the whole text.
  */
-static void
-draw_scrolled(const char* text,
-              int total_chars,
-              size_t i,
-              int screen_width,
-              char* typed,
-              int current_index);
+struct glyph_table
+{
+  const char* text;
+  uint32_t n;
+  uint32_t cap;
+  uint32_t raw;
+  int ascii;
+  uint32_t* cp;
+  uint32_t* off;
+  uint32_t* col;
+};
 
 /**
- * calc_speed - Get WPM and CPM values from a file.
- * @filename: Path to the file to read.
- * @elapsed: Total elapsed time.
- * @wpm: Words typed per minute value.
- * @cpm: Characters typed per minute value.
+ * wrap_layout - Line-break table of a text for one screen width.
  *
- * This function reads the file specified by 'filename',
- * counts the total non-whitespace characters, and then calculates
- * the characters per minute (CPM) and words per minute (WPM) based on
- * the elapsed time (in seconds).
+ * Line n covers glyphs [starts[n], starts[n + 1]) of the text, so `starts`
+ * holds `nlines + 1` entries. Lines break after whitespace (or after a
+ * newline) and only inside a word when the word is wider than the screen.
+ *
+ * @width: Screen width the table was computed for, 0 if none yet.
+ * @nlines: Number of lines.
+ * @cap: Number of allocated entries of @starts.
+ * @starts: Start of each line, plus the end of the text.
  */
-static void
-calc_speed(const char* filename, double elapsed, double* wpm, double* cpm);
+struct wrap_layout
+{
+  int width;
+  int nlines;
+  int cap;
+  int* starts;
+};
 
 /**
- * Creates the file $HOME/.local/state/typc/data.csv, including all parent
- * directories. Returns 0 on success, -1 on failure.
+ * key_event - One keystroke of a typing session.
+ *
+ * @t_ns: CLOCK_MONOTONIC time the key was read, in nanoseconds.
+ * @index: Cursor position before the key was applied.
+ * @ch: The key, as returned by read_key.
  */
-static int
-create_data_csv(void);
+struct key_event
+{
+  uint64_t t_ns;
+  uint32_t index;
+  int32_t ch;
+};
 
 /**
- * read_file - Read an entire file into a buffer.
- * @path: Path to the file to read.
+ * trace_span - One timed span of --trace, an entry of the trace ring.
  *
- * Opens the file, reads its content into a dynamically allocated buffer,
- * and null-terminates the string. Returns the buffer on success, or NULL on
- * error.
+ * @name: What was timed, a string literal.
+ * @tid: Thread it ran on, 1 for the main thread.
+ * @start_ns: When it started, from now_ns.
+ * @dur_ns: How long it took.
  */
-static char*
-read_file(const char* path);
+struct trace_span
+{
+  const char* name;
+  int tid;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+};
 
 /**
- * seed_rng - Seed the random number generator.
+ * key_log - Preallocated per-session buffer of keystrokes.
  *
- * Seeds the random number generator using the current time.
+ * Sized up front from the text length so that recording a key never
+ * allocates. Keys past @cap are counted in @dropped but still move @last_ns,
+ * so timing stays exact even if the buffer fills up.
+ *
+ * @ev: The recorded keystrokes.
+ * @len: Number of recorded keystrokes.
+ * @cap: Capacity of @ev.
+ * @dropped: Keystrokes that did not fit.
+ * @first_ns: Time of the first keystroke.
+ * @last_ns: Time of the last keystroke.
  */
-static void
-seed_rng(void);
+struct key_log
+{
+  struct key_event* ev;
+  size_t len;
+  size_t cap;
+  size_t dropped;
+  uint64_t first_ns;
+  uint64_t last_ns;
+};
 
 /**
- * save_score - Save the typing test score to a file.
- * @wpm: Words per minute.
- * @cpm: Characters per minute.
- * @accuracy: Accuracy in percentage.
- * @consistency: Consistency in percentage.
- * @path: Name of the file path.
- *
- * Opens the scores file (creating it if necessary) and appends a new line
- * containing the WPM, CPM, accuracy, and consistency metrics, separated by
- * commas.
+ * slow_bigram - A character transition and its mean latency.
  */
-static void
-save_score(double wpm,
-           double cpm,
-           double accuracy,
-           double consistency,
-           char* path);
+struct slow_bigram
+{
+  char pair[3];
+  double mean_ms;
+};
 
 /**
- * init_ncurses - Initialize ncurses
+ * latency_stats - Inter-key timing of one session.
+ *
+ * All storage is fixed-size: intervals go into a histogram with LAT_BUCKETS
+ * logarithmic buckets (in microseconds) plus a running mean and variance, and
+ * transitions between printable characters are summed in a
+ * BIGRAM_CHARS x BIGRAM_CHARS table.
  *
- * Initialize screen, keypad, etc.
+ * @hist: Interval histogram, see latency_bucket.
+ * @n: Number of intervals.
+ * @mean_us: Mean interval.
+ * @m2: Sum of squared deviations from the mean (Welford).
+ * @bigram_us: Total latency per (previous, current) key pair.
+ * @bigram_n: Number of samples per key pair.
+ * @consistency: 100 * (1 - coefficient of variation), clamped to [0, 100].
+ * @p50_ms: Median interval.
+ * @p95_ms: 95th percentile interval.
+ * @p99_ms: 99th percentile interval.
+ * @slow: The slowest transitions by mean latency.
+ * @nslow: Number of valid entries in @slow.
  */
-static void
-__init_ncurses(void);
+struct latency_stats
+{
+  uint32_t hist[LAT_BUCKETS];
+  size_t n;
+  double mean_us;
+  double m2;
+  uint64_t bigram_us[BIGRAM_CHARS * BIGRAM_CHARS];
+  uint32_t bigram_n[BIGRAM_CHARS * BIGRAM_CHARS];
+  double consistency;
+  double p50_ms;
+  double p95_ms;
+  double p99_ms;
+  struct slow_bigram slow[SLOW_BIGRAMS];
+  int nslow;
+};
 
 /**
- * average_word_length - Calculate average word length from string.
- *
- * Used in calculating text metrics.
+ * key_stats - Per-key and per-bigram counters of one session.
  *
- * @s: String taken from file contents.
- * @see read_file
+ * Indexed by printable character minus PRINT_CHAR_MIN like the bigram table
+ * of latency_stats, but counted by the character that was expected, so that
+ * a miss is charged to the key that should have been hit. A bigram is the
+ * expected character before the cursor and the one at it. session_key
+ * updates the counters as keys arrive, in constant time and without
+ * allocating; session_begin clears them.
  *
- * Returns the average word length as a double.
+ * @key_n: Attempts at each character.
+ * @key_err: Attempts that typed something else.
+ * @key_us: Total time since the previous key, in microseconds; the first key
+ * of a session adds nothing.
+ * @bigram_n: Attempts at each bigram.
+ * @bigram_err: Attempts at it that missed its second character.
+ * @bigram_us: Total time of its second character.
  */
-static double
-average_word_length(const char* s);
+struct key_stats
+{
+  uint32_t key_n[BIGRAM_CHARS];
+  uint32_t key_err[BIGRAM_CHARS];
+  uint64_t key_us[BIGRAM_CHARS];
+  uint32_t bigram_n[BIGRAM_CHARS * BIGRAM_CHARS];
+  uint32_t bigram_err[BIGRAM_CHARS * BIGRAM_CHARS];
+  uint64_t bigram_us[BIGRAM_CHARS * BIGRAM_CHARS];
+};
 
 /**
- * run_typing_trainer - Run an ncurses-based typing trainer.
- * @path: Path to the file containing the text.
- * @text: The text to be typed by the user.
+ * profile_file - The keystroke profile, all sessions' key_stats summed.
  *
- * Uses ncurses to display the text for typing.
+ * The file is exactly one of these, in host byte order, and is mapped for
+ * the whole process. profile_merge adds a session to it in time
+ * proportional to the tables, however long the history.
  *
- * In normal mode, horizontal scrolling is implemented so that the current
- * position remains visible. In wrap mode, the text is wrapped to the screen
- * width.
+ * @magic: PROFILE_MAGIC.
+ * @version: PROFILE_VERSION.
+ * @chars: BIGRAM_CHARS, the side of the tables.
+ * @sessions: Sessions merged.
+ */
+struct profile_file
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t chars;
+  uint64_t sessions;
+  uint64_t key_n[BIGRAM_CHARS];
+  uint64_t key_err[BIGRAM_CHARS];
+  uint64_t key_us[BIGRAM_CHARS];
+  uint64_t bigram_n[BIGRAM_CHARS * BIGRAM_CHARS];
+  uint64_t bigram_err[BIGRAM_CHARS * BIGRAM_CHARS];
+  uint64_t bigram_us[BIGRAM_CHARS * BIGRAM_CHARS];
+};
+
+/**
+ * weakness - The user's weak spots, in the feature space of text_features.
  *
- * The already typed text is displayed character-by-character:
- * - Correct characters are shown in white.
- * - Incorrect characters are shown in red (or shown as the expected character
- * if HIDE_ERR is 1).
+ * @w: Weight per feature: the recent error rate for character features and
+ * the relative slowdown for bigram buckets. Each session halves the previous
+ * weights before adding its own.
+ * @sessions: Number of sessions (or seeded CSV rows) folded in.
+ */
+struct weakness
+{
+  float w[FEAT_DIMS];
+  int sessions;
+};
+
+/**
+ * score_file_header - Header of the binary score store.
  *
- * The untyped text is rendered in a dim (grayish) style.
- * Backspace support allows corrections.
- * Upon completion, the function calculates and displays the words-per-minute
- * (WPM), characters-per-minute (CPM), and the accuracy metric.
+ * The store is the header, followed by fixed-size score_record entries in the
+ * order they were saved, followed by a score_footer, its `nbest` score_best
+ * entries and a score_trailer. The footer holds running aggregates so that
+ * --stats reads a constant amount of data no matter how long the history is.
  */
-static void
-run_typing_trainer(char* path, const char* text);
+struct score_file_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
 
 /**
- * usage - Print program usage.
- * @progname: The program name.
+ * score_record - One saved test.
  *
- * Sends the program usage details to stderr.
+ * @tag: SCORE_RECORD_TAG, used to find the end of the records when the footer
+ * was never written.
+ * @time: Wall-clock time the test finished (seconds since the epoch).
+ * @text_id: Content hash of the text (see hash_text), or of the path for a
+ * stream.
  */
-static void
-usage(char* progname);
+struct score_record
+{
+  uint32_t tag;
+  uint32_t reserved;
+  int64_t time;
+  uint64_t text_id;
+  float wpm;
+  float cpm;
+  float accuracy;
+  float consistency;
+  float p50_ms;
+  float p95_ms;
+  float p99_ms;
+  float reserved2;
+};
 
 /**
- * Construct directory from path.
+ * score_footer - Running aggregates over all records of the store.
  *
- * This takes all directory components including parent dirs and constructs one
- * from a given path argument.
+ * @recent_wpm: Ring of the last SCORE_RECENT WPM values, for the trend.
+ * @nbest: Number of score_best entries following the footer.
+ */
+struct score_footer
+{
+  uint64_t count;
+  double sum_wpm;
+  double sum_accuracy;
+  double min_wpm;
+  double max_wpm;
+  float recent_wpm[SCORE_RECENT];
+  uint32_t recent_len;
+  uint32_t recent_pos;
+  uint32_t nbest;
+  uint32_t reserved;
+};
+
+/**
+ * score_best - Personal best for one text.
+ */
+struct score_best
+{
+  uint64_t text_id;
+  int64_t time;
+  float wpm;
+  float accuracy;
+  char name[48];
+};
+
+/**
+ * score_trailer - Last bytes of the store, locating the footer.
+ */
+struct score_trailer
+{
+  uint64_t footer_off;
+  char magic[8];
+};
+
+/**
+ * render_state - What the last frame put on screen.
  *
- * @path - The path to construct the directory from.
+ * Lets a frame repaint only the cells that changed since the previous one
+ * instead of clearing and redrawing the whole text.
  *
- * Returns the status code of the create directories operation where != 0 is
- * err.
+ * @full: Repaint everything on the next frame (first frame, KEY_RESIZE).
+ * @width: Screen width of the last frame.
+ * @offset: Horizontal scroll offset of the last frame, or the first visible
+ * line in wrap mode.
+ * @index: Cursor position of the last frame.
+ * @layout: Line-break table used in wrap mode.
  */
-static int
-__create_directories(const char* path);
+struct render_state
+{
+  int full;
+  int width;
+  int offset;
+  int index;
+  struct wrap_layout layout;
+};
 
 /**
- * draw_results - Draw results screen.
+ * session_bufs - Buffers reused by every round of a process.
  *
- * @wpm: Words per minute.
- * @cpm: Characters per minute.
- * @accuracy: Accuracy in percentage.
- * @consistency: Consistency in percentage.
+ * Allocated by the first round and only grown afterwards, so that a
+ * multi-round session does not allocate per text once warmed up.
+ *
+ * @glyphs: Glyph table of the text of the current round.
+ * @typed: The characters typed so far, as code points.
+ * @typed_cap: Allocated entries of @typed.
+ * @cur: Cursor position in the current round.
+ * @total: Length of the current text.
+ * @base: Characters of a text stream already dropped in front of @text.
+ * @correct: Positions before @cur that hold the right character.
+ * @errors: Wrong characters typed, including ones corrected since.
+ * @roll: Time and cursor position after each of the last ROLL_KEYS keys,
+ * for the current speed shown by draw_status.
+ * @roll_len: Valid entries in @roll.
+ * @roll_pos: Next entry of @roll to overwrite.
+ * @log: Keystrokes of the current round.
+ * @rs: Render state; its line-break table is kept between rounds.
+ * @lat: Latency statistics of the current round.
+ * @keys: Per-key and per-bigram counters of the current round.
  */
-static void
-draw_results(double wpm, double cpm, double accuracy, double consistency);
+struct session_bufs
+{
+  struct glyph_table glyphs;
+  uint32_t* typed;
+  size_t typed_cap;
+  size_t cur;
+  size_t total;
+  size_t base;
+  size_t correct;
+  size_t errors;
+  struct
+  {
+    uint64_t t_ns;
+    size_t cur;
+  } roll[ROLL_KEYS];
+  int roll_len;
+  int roll_pos;
+  struct key_log log;
+  struct render_state rs;
+  struct latency_stats lat;
+  struct key_stats keys;
+};
 
-/* scores file (prefixed by $HOME) */
-static char* scores_file = ".local/state/typc/data.csv";
+/**
+ * arena_block - One block of an arena; the allocations follow the header.
+ * @prev: The block filled before this one, or NULL.
+ * @size: Bytes available after the header.
+ * @used: Bytes handed out.
+ */
+struct arena_block
+{
+  struct arena_block* prev;
+  size_t size;
+  size_t used;
+};
 
-/* When in 'tty mode' (teletype mode) where text is scrolling, this is the
- * amount of characters that are shown from the position of the current cursor
- * to the position of the end of the screen.
+/* Size of the arena_block header, rounded up to ARENA_ALIGN */
+#define ARENA_HDR                                                              \
+  ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * arena - Bump allocator for the memory of one round.
+ *
+ * Everything a round needs beyond the reused session_bufs (the text read
+ * from ENTRIES_DIR, its name, the window of a text stream) is carved out of
+ * an arena and given back all at once by arena_reset. After a reset the
+ * arena is a single block as large as the biggest round so far, so rounds
+ * that are no bigger cost no allocations at all.
+ *
+ * @head: The block being filled, or NULL before the first allocation.
+ * @live: Bytes handed out since the last reset.
+ * @peak: Most bytes handed out at once since the last reset.
  */
-static int char_offset = 20;
+struct arena
+{
+  struct arena_block* head;
+  size_t live;
+  size_t peak;
+};
 
-/* Can be modified with --debug */
-static int debug = 0;
+/**
+ * arena_mark - A point to roll an arena back to with arena_release.
+ */
+struct arena_mark
+{
+  struct arena_block* block;
+  size_t used;
+  size_t live;
+};
 
-/* Home dir value. Used for saving to csv files and other stuff. Needs to be
- * static as it's accessed by multiple other static functions */
-static char* home_dir;
+/**
+ * session_result - Scores of a finished round.
+ */
+struct session_result
+{
+  double wpm;
+  double cpm;
+  double accuracy;
+  double consistency;
+};
 
-/* Global flag to control text wrapping mode */
-static int wrap_mode = 0;
+/**
+ * score_acc - Scores summed over many replayed sessions.
+ *
+ * @skipped: Sessions that were recorded incomplete and not scored.
+ */
+struct score_acc
+{
+  size_t sessions;
+  size_t keys;
+  size_t skipped;
+  double sum_wpm;
+  double sum_accuracy;
+  double sum_consistency;
+  double min_wpm;
+  double max_wpm;
+};
 
 /**
- * main - Entry point for the typing trainer program.
+ * record_header - Header of one session in a keystroke record file.
  *
- * Reads a random text file from the ENTRIES_DIR directory and launches the
- * typing trainer. A "--wrap" argument enables text wrapping mode. Returns 0 on
- * success, or a non-zero value on error.
+ * Followed by the null-terminated path and text of the session and then
+ * `keys_size` bytes holding `nkeys` keys. Each key is the code point typed
+ * (or RECORD_BACKSPACE) and the time since the previous key in nanoseconds,
+ * both as LEB128 varints, so a key usually takes 5 bytes and replays with
+ * exactly the recorded timing. Version 1 stored the key as a single byte. A
+ * record file is any number of sessions back to back.
  */
-int
-main(int argc, char** argv)
+struct record_header
 {
-  char* rand_file = NULL;
-  char* file_contents = NULL;
-  char* full_path = NULL;
+  char magic[8];
+  uint32_t version;
+  uint32_t path_len;
+  uint32_t text_len;
+  uint32_t nkeys;
+  uint32_t keys_size;
+  uint32_t reserved;
+};
 
-  parse_args(argc, argv);
+/**
+ * text_choice - A text selected for one round.
+ *
+ * @path: Path of the text under ENTRIES_DIR.
+ * @text: The text, in the arena it was chosen into.
+ * @metrics: Metrics of @text.
+ * @entry: Index of the text in the corpus, or CORPUS_NONE.
+ * @id: Content hash of @text, which scores are saved under.
+ */
+struct text_choice
+{
+  char path[MAX_PATH_SIZE];
+  const char* text;
+  struct text_metrics metrics;
+  uint32_t entry;
+  uint64_t id;
+};
 
-  seed_rng();
+/**
+ * startup_job - What main does before the first round, split between two
+ * shards of run_workers (see startup_worker).
+ *
+ * @corpus: The corpus to open.
+ * @have_corpus: Set if @corpus could be opened.
+ * @arena: Arena of the first text.
+ * @choice: Receives the first text, unless texts are streamed.
+ * @ret: 0, or -1 if no text could be chosen.
+ * @state: Result of state_open.
+ * @t_begin: When opening the corpus started, for --trace, which shows the
+ * spans of startup_text as thread 2.
+ * @t_corpus: When it was open and choosing the text started.
+ * @t_text: When the text was chosen and opening the state files started.
+ * @t_end: When they were open.
+ */
+struct startup_job
+{
+  struct corpus* corpus;
+  int have_corpus;
+  struct arena* arena;
+  struct text_choice* choice;
+  int ret;
+  int state;
+  uint64_t t_begin;
+  uint64_t t_corpus;
+  uint64_t t_text;
+  uint64_t t_end;
+};
 
-  full_path = malloc(MAX_PATH_SIZE);
-  if (!full_path) {
-    perror("malloc");
-    return 1;
-  }
+/**
+ * corpus - A packed corpus mapped into memory.
+ */
+struct corpus
+{
+  const unsigned char* base;
+  size_t size;
+  const struct corpus_header* hdr;
+  const struct corpus_entry* entries;
+  const uint8_t* feats;
+};
 
-  rand_file = select_random_file();
-  if (!rand_file) {
-    perror("random_file_from_dir");
-    return 1;
-  }
+/**
+ * text_stream - Continuous text for --time and --words.
+ *
+ * Texts are taken one after another with choose_text and appended to a
+ * window of at most STREAM_CAP bytes, which stream_advance slides
+ * along behind the cursor. Memory therefore stays the same however long the
+ * test runs. Whitespace is collapsed into single spaces and characters that
+ * cannot be typed are dropped.
+ *
+ * The texts read from ENTRIES_DIR for a stream are released from its arena
+ * as soon as they have been copied into the window.
+ *
+ * The window is kept contiguous rather than used as a ring, so that the
+ * renderer and session_key index it like any other text; sliding it is a
+ * memmove every STREAM_CAP - STREAM_KEEP - STREAM_AHEAD characters.
+ *
+ * @buf: The window, null-terminated.
+ * @len: Bytes in @buf.
+ * @words_left: Words still to add for --words, or -1 for --time.
+ * @done: Metrics of the characters dropped from the window.
+ * @done_word: Length of the word @done ends inside, 0 if the window was cut
+ * between words (see text_metrics_add).
+ * @est: Metrics of the first window, used by the live ticker.
+ * @corpus: Where texts come from, or NULL for ENTRIES_DIR.
+ * @arena: Where @buf and the texts read from ENTRIES_DIR live.
+ * @src_mark: Where @src starts in @arena; it is released once used up.
+ * @src: The text being added; @pos is its next character.
+ * @have_src: Whether @src is valid.
+ * @space: The last character added was a space (or nothing was added).
+ * @end: Nothing more will be added.
+ */
+struct text_stream
+{
+  char* buf;
+  size_t len;
+  long words_left;
+  struct text_metrics done;
+  size_t done_word;
+  struct text_metrics est;
+  const struct corpus* corpus;
+  struct arena* arena;
+  struct arena_mark src_mark;
+  struct text_choice src;
+  size_t pos;
+  int have_src;
+  int space;
+  int end;
+};
 
-  snprintf(full_path, MAX_PATH_SIZE, "%s/%s", ENTRIES_DIR, rand_file);
-  if (debug == 1) {
-    fprintf(stdout, "[debug] reading %s\n", full_path);
-  }
-  file_contents = read_file(full_path);
-  if (!file_contents) {
-    perror("read_file");
-    if (full_path != NULL) {
-      free(full_path);
-    }
-    return 1;
-  }
+/**
+ * race_texts - Where the texts of --serve come from, see pick_race_text.
+ * @have_corpus: Whether @corpus is open.
+ * @arena: Memory of the race text.
+ * @choice: The race text.
+ */
+struct race_texts
+{
+  int have_corpus;
+  struct corpus corpus;
+  struct arena arena;
+  struct text_choice choice;
+};
 
-  run_typing_trainer(full_path, file_contents);
+/* select_random_file - Select a random file from a given directory.
+ *
+ * Names are taken from INDEX_FILE while its recorded mtime matches that of
+ * ENTRIES_DIR, so selection is one random draw and one lookup. Otherwise the
+ * directory is scanned and the index is rewritten (if permitted) for the next
+ * run.
+ *
+ * @a: Arena for the name.
+ *
+ * @returns the selected file, allocated from @a
+ *
+ */
+static char*
+select_random_file(struct arena* a);
 
-  free(file_contents);
-  free(full_path);
-  return 0;
-}
+/**
+ * list_texts - List the regular files of a directory.
+ * @dir: The directory to list.
+ * @count: Set to the number of names returned.
+ *
+ * The names are sorted, so listing an unchanged directory always gives the
+ * same order. Free the result with free_names.
+ *
+ * Returns the array of names, or NULL on error or if there are none.
+ */
+static char**
+list_texts(const char* dir, size_t* count);
 
-int
-__create_directories(const char* path)
-{
-  size_t len;
-  char* tmp = strdup(path);
-  char* p;
+/**
+ * free_names - Free an array returned by list_texts.
+ * @names: The array.
+ * @count: Number of names in the array.
+ */
+static void
+free_names(char** names, size_t count);
 
-  if (tmp == NULL) {
-    perror("strdup");
-    return -1;
-  }
+/**
+ * dir_mtime - Get the modification time of a directory.
+ * @dir: The directory.
+ * @ts: Set to its mtime.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+dir_mtime(const char* dir, struct timespec* ts);
 
-  len = strlen(tmp);
-  if (len == 0) {
-    free(tmp);
+/**
+ * write_name_index - Save a name index for select_random_file.
+ * @path: Path of the index file.
+ * @names: Sorted entry names.
+ * @count: Number of names.
+ * @mtime: Modification time of the directory the names came from.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+write_name_index(const char* path,
+                 char** names,
+                 size_t count,
+                 const struct timespec* mtime);
+
+/**
+ * build_corpus - Pack every text of a directory into one indexed file.
+ * @dir: Directory holding the texts.
+ * @out: Path of the corpus file to write.
+ *
+ * Texts are normalised with text_normalise and hashed with hash_text, and
+ * a text whose content repeats one earlier in name order is left out.
+ *
+ * The corpus is written to a temporary file next to @out and renamed into
+ * place, so running sessions keep their mapping of the previous corpus.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+build_corpus(const char* dir, const char* out);
+
+/**
+ * corpus_open - Map a packed corpus into memory.
+ * @c: The corpus to fill in.
+ * @path: Path of the corpus file.
+ *
+ * Only the header is validated here; entries are validated when they are
+ * accessed so that opening stays O(1) in the number of texts.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+corpus_open(struct corpus* c, const char* path);
+
+/**
+ * corpus_close - Unmap a corpus opened by corpus_open.
+ * @c: The corpus.
+ */
+static void
+corpus_close(struct corpus* c);
+
+/**
+ * corpus_get - Look up a corpus entry.
+ * @c: The corpus.
+ * @idx: Index of the entry.
+ * @a: Arena the text is inflated into.
+ * @name: Set to the entry name (null-terminated, inside the mapping).
+ * @text: Set to the entry text (null-terminated, inside @a).
+ * @m: Set to the entry's precomputed metrics.
+ *
+ * The inflate state is taken from @a as well and given back before this
+ * returns, so only the text stays allocated.
+ *
+ * Returns 0 on success, or -1 if the index or the entry is invalid or @a
+ * runs out of memory.
+ */
+static int
+corpus_get(const struct corpus* c,
+           uint32_t idx,
+           struct arena* a,
+           const char** name,
+           const char** text,
+           struct text_metrics* m);
+
+/**
+ * feat_char - Feature dimension of a character.
+ * @c: The character.
+ *
+ * Returns the dimension, or -1 for whitespace and non-printable characters.
+ */
+static int
+feat_char(int c);
+
+/**
+ * feat_bigram - Feature dimension of a pair of characters.
+ * @a: The first character.
+ * @b: The second character.
+ *
+ * Returns the bigram bucket, or -1 if either character is not a printable
+ * non-space character.
+ */
+static int
+feat_bigram(int a, int b);
+
+/**
+ * text_features - Compute the feature vector of a text.
+ * @s: The text.
+ * @feat: Receives FEAT_DIMS bytes, each the share of the text in one feature.
+ */
+static void
+text_features(const char* s, uint8_t* feat);
+
+/**
+ * weakness_update - Fold a finished session into a weakness profile.
+ * @w: The profile.
+ * @g: Glyph table of the text that was typed.
+ * @log: Keystrokes of the session.
+ * @lat: Latency statistics of the session.
+ */
+static void
+weakness_update(struct weakness* w,
+                const struct glyph_table* g,
+                const struct key_log* log,
+                const struct latency_stats* lat);
+
+/**
+ * weakness_seed - Seed a weakness profile from the slow bigrams of recent
+ * tests in the scores CSV.
+ * @w: The profile.
+ * @path: The scores CSV.
+ *
+ * Only the last FEAT_SEED_BYTES of the file are read.
+ */
+static void
+weakness_seed(struct weakness* w, const char* path);
+
+/**
+ * pick_entry - Choose the corpus entry for the next round.
+ * @c: The corpus.
+ *
+ * Uniform unless --adaptive is given and there is a weakness profile; then
+ * FEAT_CANDIDATES random entries are scored by the dot product of their
+ * feature vector with the profile, and one of the FEAT_TOP best is drawn with
+ * a chance proportional to its score. A small corpus is scored whole, and
+ * the draw still varies the text from round to round.
+ */
+static uint32_t
+pick_entry(const struct corpus* c);
+
+/**
+ * parse_args - A function to parse arguments from argv.
+ *
+ * @argv - The arguments themselves
+ * @argc - Number of arguments
+ *
+ */
+static void
+parse_args(int argc, char** argv);
+
+/**
+ * @g - Glyph table of the text to draw
+ * @layout - Line-break table of the text for the current screen width.
+ * @top - The first line to show.
+ * @rows - The number of rows that can be used.
+ * @typed - The characters that have already been typed.
+ * @current_index - The current position of the cursor respective to
+ * `total_chars`.
+ *
+ * Draw wrapped text. I.e. show all the text that can be possibly shown within
+ * the contraints of the width and height of the terminal display. This is with
+ * the --wrap option. By default the --wrap option if not toggled on. Only the
+ * lines from @top that fit on screen are drawn.
+ */
+static void
+draw_wrapped(const struct glyph_table* g,
+             const struct wrap_layout* layout,
+             int top,
+             int rows,
+             const uint32_t* typed,
+             int current_index);
+
+/**
+ * wrap_layout_build - Compute the line-break table of a text.
+ *
+ * @l: The layout to fill in; its table is reused if large enough.
+ * @g: Glyph table of the text.
+ * @width: The number of columns that can be used.
+ *
+ * Returns 0 on success, -1 on allocation failure.
+ */
+static int
+wrap_layout_build(struct wrap_layout* l,
+                  const struct glyph_table* g,
+                  int width);
+
+/**
+ * wrap_line_of - Find the line holding a position of the text.
+ *
+ * @l: The layout.
+ * @i: The position.
+ *
+ * Returns the line number, O(log nlines).
+ */
+static int
+wrap_line_of(const struct wrap_layout* l, int i);
+
+/**
+ * @draw_scrolled - Draw scrolled text.
+ *
+ * @g - Glyph table of the text to draw.
+ * @offset - The first glyph shown, from scroll_offset
+ * @screen_width - self explainatory
+ * @typed - chars already typed. Should be none.
+ * @current_index - chars already typed. Should be none.
+ *
+ */
+static void
+draw_scrolled(const struct glyph_table* g,
+              int offset,
+              int screen_width,
+              const uint32_t* typed,
+              int current_index);
+
+/**
+ * scroll_offset - Index of the first glyph shown in scrolled mode.
+ *
+ * @g: Glyph table of the text.
+ * @current_index: The cursor position.
+ * @screen_width: The number of columns that can be used.
+ * @prev: The offset of the previous frame. The search starts there, so
+ * following the cursor costs O(1) per key.
+ */
+static int
+scroll_offset(const struct glyph_table* g,
+              int current_index,
+              int screen_width,
+              int prev);
+
+/**
+ * mismatch_mask - Compare two runs of code points, 64 at a time.
+ *
+ * @a: The first run.
+ * @b: The second run.
+ * @n: Length of both runs.
+ * @mask: Receives (n + 63) / 64 words; bit i % 64 of word i / 64 is set
+ * where a[i] and b[i] differ, and the bits past @n are clear.
+ *
+ * Four code points are compared per SSE2 or NEON instruction where the
+ * target has either, with a scalar loop for the rest and everywhere else.
+ */
+static void
+mismatch_mask(const uint32_t* a, const uint32_t* b, size_t n, uint64_t* mask);
+
+/**
+ * draw_span - Draw a contiguous part of the text on one screen row.
+ *
+ * @row: Screen row to draw on.
+ * @col: Screen column of the first character.
+ * @g: Glyph table of the text being typed.
+ * @typed: The characters that have already been typed.
+ * @from: The first glyph to draw.
+ * @to: One past the last glyph to draw.
+ * @current_index: The cursor position.
+ *
+ * The span is split into runs of correct, incorrect and untyped characters,
+ * whose ends are found in the mismatch_mask of the typed part, and each run
+ * is written with a single attribute change and a single
+ * mvaddnstr call of its UTF-8 bytes rather than per character. Runs of ASCII
+ * texts are written as cells that already carry their attribute.
+ */
+static void
+draw_span(int row,
+          int col,
+          const struct glyph_table* g,
+          const uint32_t* typed,
+          int from,
+          int to,
+          int current_index);
+
+/**
+ * render_fn - Bring the screen up to date with the typing state.
+ *
+ * @rs: What the previous frame drew; updated to describe this one.
+ * @g: Glyph table of the text to draw.
+ * @screen_width: The number of columns that can be used.
+ * @typed: The characters that have already been typed.
+ * @current_index: The cursor position.
+ *
+ * The text is only redrawn in full when @rs asks for it or the width changed.
+ * Otherwise only the cells between the previous and the current cursor
+ * position are repainted, which covers both the character just typed or
+ * erased and the cursor cell.
+ *
+ * There is one renderer per display mode, picked once by parse_args (see
+ * render_frame), so the per-key path never tests the mode.
+ */
+typedef void
+render_fn(struct render_state* rs,
+          const struct glyph_table* g,
+          int screen_width,
+          const uint32_t* typed,
+          int current_index);
+
+/**
+ * render_scrolled - The render_fn of the default mode, one row scrolled
+ * horizontally; the row is redrawn whenever the scroll window moves.
+ */
+static render_fn render_scrolled;
+
+/**
+ * render_wrapped - The render_fn of --wrap; the screen is redrawn when the
+ * cursor line scrolls.
+ */
+static render_fn render_wrapped;
+
+/**
+ * calc_speed - Get WPM and CPM values for a text.
+ * @m: Metrics of the typed text.
+ * @elapsed: Total elapsed time.
+ * @wpm: Words typed per minute value.
+ * @cpm: Characters typed per minute value.
+ *
+ * This function calculates the characters per minute (CPM) from the text's
+ * non-whitespace characters and the elapsed time (in seconds), and the words
+ * per minute (WPM) from the CPM and the average word length.
+ */
+static void
+calc_speed(const struct text_metrics* m,
+           double elapsed,
+           double* wpm,
+           double* cpm);
+
+/**
+ * Creates the file $HOME/.local/state/typc/data.csv, including all parent
+ * directories, and opens it for appending as `scores_fp`. Called once, by
+ * state_open; the file stays open until close_data_csv. Returns 0 on success,
+ * -1 on failure.
+ */
+static int
+create_data_csv(void);
+
+/**
+ * state_open - Resolve and open the scores files and the keystroke profile.
+ *
+ * Runs once per process; later calls return the first result. main calls it
+ * before ncurses starts for --adaptive, which seeds its profile from past
+ * scores before choosing a text, for --debug, so that its messages are not
+ * drawn over by ncurses, and for --join. Otherwise startup_text calls it
+ * once the first text is chosen, while ncurses comes up. Either way typc
+ * gives up before anything is typed if it fails.
+ *
+ * Returns 0 if scores will be saved, -1 if not.
+ */
+static int
+state_open(void);
+
+/* state_warn - Tell the user that scores cannot be saved; after endwin. */
+static void
+state_warn(void);
+
+/**
+ * close_data_csv - Flush and close the scores file.
+ *
+ * Scores are buffered for the whole process and synced to disk once here.
+ * Registered with atexit by create_data_csv, so it also runs on the
+ * exit(EXIT_FAILURE) paths.
+ */
+static void
+close_data_csv(void);
+
+/**
+ * score_store_open - Open the binary score store for appending.
+ *
+ * Opens $HOME/.local/state/typc/scores.bin (after create_data_csv has made
+ * its directory) and writes its header if it is new. No lock is held
+ * between appends, so any number of processes can record to the store;
+ * score_store_close is registered with atexit.
+ *
+ * Returns 0 on success, -1 on failure (scores then only go to the CSV).
+ */
+static int
+score_store_open(void);
+
+/**
+ * score_store_add - Append a record to the score store.
+ * @r: The record.
+ * @name: Display name of the text, kept with its personal best.
+ *
+ * Under a short lock, the footer is read back (which picks up records of
+ * other processes), the record is written over it and the updated footer
+ * after the record, so the file on disk always ends in a valid footer.
+ */
+static void
+score_store_add(const struct score_record* r, const char* name);
+
+/**
+ * score_store_close - Sync the score store to disk and close it.
+ */
+static void
+score_store_close(void);
+
+/**
+ * profile_open - Map the keystroke profile.
+ *
+ * Maps $HOME/.local/state/typc/profile.bin (after create_data_csv has made
+ * its directory) for the rest of the process, creating it if needed. A file
+ * of another version or table size is started afresh.
+ *
+ * Returns 0 on success, -1 on failure (sessions are then not profiled).
+ */
+static int
+profile_open(void);
+
+/**
+ * profile_merge - Add a session's counters to the keystroke profile.
+ * @s: The session's counters.
+ *
+ * Holds a lock on the file while adding, so that processes finishing at
+ * the same time do not lose each other's counts. Does nothing if the
+ * profile is not open.
+ */
+static void
+profile_merge(const struct key_stats* s);
+
+/**
+ * print_stats - Print all-time statistics from the score store.
+ *
+ * Only the footer is read, so this takes constant time in the number of
+ * saved tests. Used by --stats.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+print_stats(void);
+
+/**
+ * print_csv_stats - Print statistics from a scores CSV file.
+ * @path: The CSV file, in the format written by save_score.
+ *
+ * For histories that predate the binary score store. The file is mapped and
+ * parsed in a single streaming pass in constant memory, so it copes with
+ * merged histories of hundreds of megabytes.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+print_csv_stats(const char* path);
+
+/**
+ * hash_str - 64-bit hash of a string.
+ * @s: The string.
+ */
+static uint64_t
+hash_str(const char* s);
+
+/**
+ * hash_text - Content hash of a text, which identifies it in the scores.
+ * @s: The text.
+ * @n: Its length in bytes.
+ *
+ * This is XXH64 with seed 0, reading the bytes in little-endian order, so a
+ * text has the same id on every machine.
+ */
+static uint64_t
+hash_text(const char* s, size_t n);
+
+/**
+ * text_normalise - Normalise the whitespace of a text in place.
+ * @s: The text.
+ *
+ * Every run of whitespace becomes a single space and whitespace at either
+ * end is removed, so a text never ends in a character that is easy to miss
+ * and texts that differ only in spacing hash alike.
+ *
+ * Returns the new length of @s.
+ */
+static size_t
+text_normalise(char* s);
+
+/**
+ * read_file - Read an entire file into a buffer.
+ * @path: Path to the file to read.
+ * @a: Arena for the buffer, or NULL to allocate it with malloc.
+ *
+ * Opens the file, reads its content into a buffer from @a (or a dynamically
+ * allocated one, which the caller frees), and null-terminates the string.
+ * Returns the buffer on success, or NULL on error.
+ */
+static char*
+read_file(const char* path, struct arena* a);
+
+/**
+ * seed_rng - Seed the random number generator.
+ *
+ * Seeds the random number generator using the current time.
+ */
+static void
+seed_rng(void);
+
+/**
+ * save_score - Save the typing test score to a file.
+ * @wpm: Words per minute.
+ * @cpm: Characters per minute.
+ * @accuracy: Accuracy in percentage.
+ * @consistency: Consistency in percentage.
+ * @path: Name of the file path.
+ * @text_id: Content hash of the text (see hash_text), or 0 for a stream.
+ * @lat: Latency statistics of the session.
+ *
+ * Appends a new line to the scores file opened by create_data_csv,
+ * containing the WPM, CPM, accuracy, and consistency metrics, the text id as
+ * 16 hex digits (the path for a stream), the p50/p95/p99 latencies and the
+ * slowest bigrams, separated by commas. Does nothing if the scores file could
+ * not be opened.
+ */
+static void
+save_score(double wpm,
+           double cpm,
+           double accuracy,
+           double consistency,
+           char* path,
+           uint64_t text_id,
+           const struct latency_stats* lat);
+
+/**
+ * init_ncurses - Initialize ncurses
+ *
+ * Initialize screen, keypad, etc. main sets LC_CTYPE beforehand.
+ */
+static void
+__init_ncurses(void);
+
+/**
+ * stderr_hold - Keep stderr off the screen while ncurses owns the terminal.
+ *
+ * Points the stderr descriptor at a temporary file, so that errors printed
+ * by any thread (the startup worker included) do not go over the frames.
+ * stderr_release prints them once ncurses has ended; it is registered with
+ * atexit, so the exit(EXIT_FAILURE) paths show them too. If the file cannot
+ * be made, stderr is left as it is.
+ */
+static void
+stderr_hold(void);
+
+/* stderr_release - Restore stderr and print what was held; after endwin. */
+static void
+stderr_release(void);
+
+/**
+ * text_metrics_init - Compute the metrics of a text in one pass.
+ *
+ * @m: The metrics to fill in.
+ * @s: String taken from file contents.
+ * @see read_file
+ */
+static void
+text_metrics_init(struct text_metrics* m, const char* s);
+
+/**
+ * utf8_decode - Decode one UTF-8 sequence.
+ * @s: The sequence; it must not be at the terminating null.
+ * @cp: Receives the code point.
+ *
+ * Overlong forms, surrogates and truncated sequences are not UTF-8; their
+ * first byte is taken on its own, as the Latin-1 character of that byte.
+ *
+ * Returns the number of bytes used, at least 1.
+ */
+static size_t
+utf8_decode(const unsigned char* s, uint32_t* cp);
+
+/**
+ * utf8_glyph - Find the extent of one character of a text.
+ * @s: The start of the character; it must not be at the terminating null.
+ * @cp: Receives its code point.
+ *
+ * A character is one code point followed by any combining marks, which are
+ * drawn with it and not typed separately.
+ *
+ * Returns the number of bytes of the character.
+ */
+static size_t
+utf8_glyph(const char* s, uint32_t* cp);
+
+/**
+ * utf8_encode - Encode a code point as UTF-8.
+ * @cp: The code point, at most CODE_POINT_MAX.
+ * @out: Receives up to 4 bytes, not null-terminated.
+ *
+ * Returns the number of bytes written.
+ */
+static size_t
+utf8_encode(uint32_t cp, char* out);
+
+/**
+ * key_printable - Whether a code point is a character that can be typed.
+ * @cp: The code point.
+ *
+ * Does not depend on the locale, so that replays score the same everywhere.
+ */
+static int
+key_printable(uint32_t cp);
+
+/**
+ * glyphs_build - Fill in the glyph table of a text.
+ * @g: The table; its arrays must have room for @max glyphs.
+ * @text: The text.
+ * @max: Most glyphs to take from @text.
+ *
+ * Display widths come from wcwidth in the current locale; characters it
+ * does not know take one column.
+ */
+static void
+glyphs_build(struct glyph_table* g, const char* text, size_t max);
+
+/**
+ * read_key - Wait for one key for session_key, as set up by timeout().
+ *
+ * Returns ERR if none arrived in time, otherwise the code point of the
+ * character, RECORD_BACKSPACE for backspace or KEY_FN() of any other
+ * function key.
+ */
+static int
+read_key(void);
+
+/**
+ * run_typing_trainer - Run an ncurses-based typing trainer.
+ * @sb: Buffers reused across rounds.
+ * @path: Path to the file containing the text.
+ * @text_id: Content hash of @text, see save_score.
+ * @text: The text to be typed by the user.
+ * @m: Metrics of @text.
+ * @st: The stream @text is the window of, for --time and --words; otherwise
+ * NULL.
+ *
+ * Uses ncurses to display the text for typing.
+ *
+ * In normal mode, horizontal scrolling is implemented so that the current
+ * position remains visible. In wrap mode, the text is wrapped to the screen
+ * width.
+ *
+ * The already typed text is displayed character-by-character:
+ * - Correct characters are shown in white.
+ * - Incorrect characters are shown in red (or shown as the expected character
+ * if HIDE_ERR is 1).
+ *
+ * The untyped text is rendered in a dim (grayish) style.
+ * Backspace support allows corrections.
+ * Upon completion, the function calculates and displays the words-per-minute
+ * (WPM), characters-per-minute (CPM), and the accuracy metric. ncurses must
+ * already be initialised; the results stay on screen when it returns.
+ */
+static void
+run_typing_trainer(struct session_bufs* sb,
+                   char* path,
+                   uint64_t text_id,
+                   const char* text,
+                   const struct text_metrics* m,
+                   struct text_stream* st);
+
+/**
+ * text_metrics_add - Add the metrics of a span of a text stream to @m.
+ * @m: The metrics to add to.
+ * @s: The span.
+ * @n: Length of the span in bytes.
+ * @word: Length of the word the spans already in @m end inside, 0 if they
+ * end between words; updated to that of the word @s ends inside, so a word
+ * cut in two is still counted once. NULL if @s starts between words.
+ */
+static void
+text_metrics_add(struct text_metrics* m,
+                 const char* s,
+                 size_t n,
+                 size_t* word);
+
+/**
+ * stream_open - Start a text stream.
+ * @st: The stream.
+ * @corpus: Where texts come from, or NULL for ENTRIES_DIR.
+ * @a: Arena of the round; the stream lives until it is reset.
+ * @words: Words in the stream, or -1 for an endless stream.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+stream_open(struct text_stream* st,
+            const struct corpus* corpus,
+            struct arena* a,
+            long words);
+
+/**
+ * stream_fill - Top up the window of a text stream.
+ * @st: The stream.
+ */
+static void
+stream_fill(struct text_stream* st);
+
+/**
+ * stream_advance - Slide and refill the window once the cursor nears its
+ * end.
+ * @st: The stream typed in @sb.
+ * @sb: Buffers of the round; @typed and the cursor move with the window.
+ *
+ * Returns 1 if the window changed and needs a full repaint, otherwise 0.
+ */
+static int
+stream_advance(struct text_stream* st, struct session_bufs* sb);
+
+/**
+ * run_stream_round - Run one --time or --words round.
+ * @sb: Buffers reused across rounds.
+ * @corpus: Where texts come from, or NULL for ENTRIES_DIR.
+ * @a: Arena of the round.
+ *
+ * Returns 0 on success, -1 if no text could be streamed.
+ */
+static int
+run_stream_round(struct session_bufs* sb,
+                 const struct corpus* corpus,
+                 struct arena* a);
+
+/**
+ * draw_status - Draw the live ticker on the bottom row.
+ * @sb: Buffers of the current round.
+ * @m: Metrics of the text.
+ * @now: Current time.
+ *
+ * Shows the speed so far, the speed over the last ROLL_KEYS keys, the
+ * accuracy and errors so far and the elapsed time, all from the counters
+ * kept by session_key. Nothing is drawn when the screen has no room below
+ * the text.
+ */
+static void
+draw_status(const struct session_bufs* sb,
+            const struct text_metrics* m,
+            uint64_t now);
+
+/**
+ * session_begin - Reset the buffers of @sb for typing a new text.
+ * @sb: Buffers reused across rounds.
+ * @text: The text; it must stay valid until the round is scored.
+ * @total_chars: Characters of @text to use, and to make room for.
+ *
+ * Builds the glyph table of @text, whose length is the round's @total.
+ *
+ * Returns 0 on success, -1 if the buffers could not be grown.
+ */
+static int
+session_begin(struct session_bufs* sb, const char* text, size_t total_chars);
+
+/**
+ * session_key - Apply one key to the current round.
+ * @sb: Buffers of the round, set up by session_begin.
+ * @t_ns: Time the key was read.
+ * @ch: The key, as returned by read_key.
+ *
+ * This is the whole input state machine: backspace moves the cursor back,
+ * printable characters are stored and move it forward, and anything else
+ * is ignored, as is any key but backspace once the text has been typed.
+ * The correct and error counts and the rolling speed window are updated in
+ * O(1) along the way, so neither the live ticker nor the final score has to
+ * rescan the text. It does not touch the terminal, so recorded keys can be
+ * replayed through it.
+ *
+ * Returns 1 once the whole text has been typed, otherwise 0.
+ */
+static int
+session_key(struct session_bufs* sb, uint64_t t_ns, int ch);
+
+/**
+ * session_score - Score a finished round.
+ * @sb: Buffers of the round.
+ * @m: Metrics of the text.
+ * @r: Receives the scores; the latency statistics are left in @sb->lat.
+ */
+static void
+session_score(struct session_bufs* sb,
+              const struct text_metrics* m,
+              struct session_result* r);
+
+/**
+ * record_open - Open the keystroke record file given to --record.
+ * @path: The file; sessions are appended to it.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+record_open(const char* path);
+
+/**
+ * record_session - Append a finished round to the record file, if any.
+ * @path: Path of the text, as saved with the score.
+ * @text: The text.
+ * @log: Keystrokes of the round.
+ */
+static void
+record_session(const char* path, const char* text, const struct key_log* log);
+
+/**
+ * replay_file - Re-score every session of a keystroke record file.
+ * @path: The record file.
+ * @sb: Buffers to replay the sessions in.
+ * @acc: Accumulator the scores are added to.
+ * @print: Print the scores of each session in the CSV format of save_score.
+ *
+ * Each session is fed through session_key and session_score without a
+ * terminal. Nothing is saved. Safe to call from several threads at once as
+ * long as each has its own @sb and @acc.
+ *
+ * Returns 0 on success, -1 if the file could not be read or is corrupt.
+ */
+static int
+replay_file(const char* path,
+            struct session_bufs* sb,
+            struct score_acc* acc,
+            int print);
+
+/**
+ * replay - Re-score one record file and print every session (--replay).
+ * @path: The record file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+replay(const char* path);
+
+/**
+ * score_acc_add - Add the scores of one session to an accumulator.
+ * @a: The accumulator.
+ * @r: The scores.
+ * @keys: Keystrokes of the session.
+ */
+static void
+score_acc_add(struct score_acc* a, const struct session_result* r, size_t keys);
+
+/**
+ * score_acc_merge - Add accumulator @b into @a.
+ */
+static void
+score_acc_merge(struct score_acc* a, const struct score_acc* b);
+
+/**
+ * run_workers - Run @fn on one thread per online core.
+ * @nitems: Number of items to split; no more workers than items are used.
+ * @fn: Called as fn(ctx, w, n) for every shard w of n; a shard covers the
+ * items i with i % n == w.
+ * @ctx: Passed to @fn.
+ *
+ * The calling thread runs shard 0. If a thread cannot be created its shard
+ * runs on the calling thread as well, so every shard always runs exactly
+ * once.
+ *
+ * Returns the number of shards, n.
+ */
+static size_t
+run_workers(size_t nitems, void (*fn)(void* ctx, size_t w, size_t n), void* ctx);
+
+/**
+ * batch_replay - Re-score every session log in a directory in parallel.
+ * @dir: The directory; each regular file is a --record file.
+ *
+ * Files are sharded across run_workers; each worker sums into its own
+ * accumulator and the accumulators are merged once all have finished. A
+ * summary is printed per file and for the whole directory.
+ *
+ * Returns 0 on success, -1 if any file could not be replayed.
+ */
+static int
+batch_replay(const char* dir);
+
+/**
+ * serve_races - Run a race server on @path (--serve).
+ *
+ * Opens the corpus once and hands race_serve its texts through
+ * pick_race_text.
+ *
+ * Returns 0 on a clean stop, -1 on failure.
+ */
+static int
+serve_races(const char* path);
+
+/**
+ * pick_race_text - Choose the text of the next race; a race_pick_fn.
+ * @ctx: The struct race_texts of serve_races.
+ * @pick: Receives the text.
+ *
+ * Returns 0 on success, -1 if there is no text.
+ */
+static int
+pick_race_text(void* ctx, struct race_pick* pick);
+
+/**
+ * race_join - Take part in races of a server (--join).
+ * @path: Path of the server's Unix socket.
+ * @sb: Buffers reused across rounds.
+ *
+ * Initialises ncurses and runs races until the user quits or the server
+ * goes away. Scores are saved as for any other round.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+race_join(const char* path, struct session_bufs* sb);
+
+/**
+ * race_countdown - Show the race text until the race starts.
+ * @sb: Buffers of the round, set up by session_begin with the race text.
+ *
+ * Keys typed before the start are dropped.
+ *
+ * Returns 0 once the race has started, -1 if the connection was lost.
+ */
+static int
+race_countdown(struct session_bufs* sb);
+
+/**
+ * live_wpm - Speed of a round so far, as shown by draw_status.
+ * @sb: Buffers of the round.
+ * @m: Metrics of the text.
+ * @now: Current time.
+ */
+static double
+live_wpm(const struct session_bufs* sb,
+         const struct text_metrics* m,
+         uint64_t now);
+
+/**
+ * corpus_open_current - Open the packed corpus unless it is out of date.
+ * @c: The corpus to fill in.
+ *
+ * If texts were added to or removed from ENTRIES_DIR since the corpus was
+ * built, or it was never built, it is ignored and texts are read from
+ * ENTRIES_DIR. It is never rebuilt here, which would hold up startup; that
+ * is left to --build-corpus, which INSTALL runs.
+ *
+ * Returns 0 if @c was opened, -1 otherwise.
+ */
+static int
+corpus_open_current(struct corpus* c);
+
+/**
+ * choose_text - Select a random text for the next round.
+ * @corpus: The mapped corpus, or NULL to select from ENTRIES_DIR.
+ * @a: Arena for a text read from ENTRIES_DIR; the choice is valid until it
+ * is reset.
+ * @c: The choice to fill in.
+ *
+ * A corpus text is inflated here, so calling this ahead of the round hides
+ * that behind the results screen.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+choose_text(const struct corpus* corpus,
+            struct arena* a,
+            struct text_choice* c);
+
+/**
+ * startup_text - Open the corpus, choose the first text and open the state
+ * files (see state_open) of a startup_job.
+ * @job: The job.
+ */
+static void
+startup_text(struct startup_job* job);
+
+/**
+ * startup_worker - run_workers callback of a startup_job.
+ * @ctx: The startup_job.
+ * @w: The shard; 0 brings up ncurses, the last one runs startup_text.
+ * @n: Number of shards, 1 or 2.
+ *
+ * With two cores, the corpus is opened and the first text chosen (and
+ * inflated) while the terminal is being set up. Of the two, only shard 0
+ * calls ncurses, which is not thread-safe.
+ */
+static void
+startup_worker(void* ctx, size_t w, size_t n);
+
+/**
+ * wait_results - Wait for a key on the results screen.
+ * @last: Whether this was the last round.
+ *
+ * Returns the key pressed.
+ */
+static int
+wait_results(int last);
+
+/**
+ * session_bufs_free - Free the buffers of a session.
+ * @sb: The buffers.
+ */
+static void
+session_bufs_free(struct session_bufs* sb);
+
+/**
+ * arena_alloc - Allocate from an arena.
+ * @a: The arena.
+ * @n: Bytes to allocate; the result is aligned to ARENA_ALIGN.
+ *
+ * Returns the memory, or NULL if a new block could not be allocated.
+ */
+static void*
+arena_alloc(struct arena* a, size_t n);
+
+/**
+ * arena_strdup - Copy a string into an arena.
+ * @a: The arena.
+ * @s: The string.
+ *
+ * Returns the copy, or NULL on allocation failure.
+ */
+static char*
+arena_strdup(struct arena* a, const char* s);
+
+/**
+ * arena_save - Remember the current end of an arena.
+ * @a: The arena.
+ */
+static struct arena_mark
+arena_save(const struct arena* a);
+
+/**
+ * arena_release - Give back everything allocated since a mark.
+ * @a: The arena.
+ * @m: A mark from arena_save, taken since the last reset.
+ */
+static void
+arena_release(struct arena* a, const struct arena_mark* m);
+
+/**
+ * arena_reset - Give back everything allocated from an arena.
+ * @a: The arena.
+ *
+ * The memory is kept for the next round, merged into one block.
+ */
+static void
+arena_reset(struct arena* a);
+
+/**
+ * arena_free - Free the memory of an arena.
+ * @a: The arena.
+ */
+static void
+arena_free(struct arena* a);
+
+/**
+ * now_ns - Read the monotonic clock.
+ *
+ * Returns CLOCK_MONOTONIC in nanoseconds.
+ */
+static uint64_t
+now_ns(void);
+
+/**
+ * trace_open - Start recording spans for --trace.
+ *
+ * Allocates the ring of TRACE_CAP spans up front, so recording a span never
+ * allocates, and registers trace_dump with atexit.
+ *
+ * Returns 0 on success, -1 on allocation failure.
+ */
+static int
+trace_open(void);
+
+/**
+ * trace_begin - Start a span.
+ *
+ * Returns the start time to pass to trace_end, or 0 when not tracing, which
+ * costs a single branch.
+ */
+static uint64_t
+trace_begin(void);
+
+/**
+ * trace_end - Record a span started by trace_begin, if tracing.
+ * @name: What was timed, a string literal; it is kept, not copied.
+ * @start: The value trace_begin returned.
+ */
+static void
+trace_end(const char* name, uint64_t start);
+
+/**
+ * trace_add - Record a span that has already been timed, if tracing.
+ * @name: What was timed, a string literal.
+ * @tid: Thread it ran on.
+ * @start: Start, from trace_begin.
+ * @end: End, from trace_begin.
+ *
+ * Only the main thread records spans; other threads time their work and
+ * hand the times over to be added once they have been joined.
+ */
+static void
+trace_add(const char* name, int tid, uint64_t start, uint64_t end);
+
+/**
+ * trace_dump - Write the recorded spans to the --trace file.
+ *
+ * The file is in the Chrome trace-event format, one complete ("X") event per
+ * span with times in microseconds, so it can be loaded into chrome://tracing
+ * or Perfetto. Runs at exit.
+ */
+static void
+trace_dump(void);
+
+/**
+ * key_log_reset - Empty a key log and size it for a session.
+ * @log: The log to reset.
+ * @total_chars: Length of the text to be typed.
+ *
+ * The buffer is only reallocated when it is too small for this text.
+ *
+ * Returns 0 on success, -1 on allocation failure.
+ */
+static int
+key_log_reset(struct key_log* log, size_t total_chars);
+
+/**
+ * key_log_add - Record one keystroke.
+ * @log: The log.
+ * @t_ns: Time of the keystroke, from now_ns.
+ * @index: Cursor position before the keystroke.
+ * @ch: The key.
+ */
+static void
+key_log_add(struct key_log* log, uint64_t t_ns, size_t index, int ch);
+
+/**
+ * key_log_elapsed - Time from the first to the last keystroke.
+ * @log: The log.
+ *
+ * Returns the elapsed time in seconds.
+ */
+static double
+key_log_elapsed(const struct key_log* log);
+
+/**
+ * latency_bucket - Histogram bucket of an inter-key interval.
+ * @us: The interval in microseconds.
+ *
+ * Bucket 0 holds everything below 1 << LAT_MIN_SHIFT us. Above that, each
+ * octave is split into 1 << LAT_SUB_BITS buckets, so the relative error of a
+ * bucket is below 25%.
+ */
+static int
+latency_bucket(uint64_t us);
+
+/**
+ * latency_stats_compute - Derive latency statistics from a key log.
+ * @lat: The statistics to fill in.
+ * @log: The keystrokes of the session.
+ */
+static void
+latency_stats_compute(struct latency_stats* lat, const struct key_log* log);
+
+/**
+ * key_stats_add - Count one typed character.
+ * @s: The counters.
+ * @g: Glyphs of the text.
+ * @i: Position the character was typed at.
+ * @ch: The character typed.
+ * @dt_ns: Time since the previous key, or 0 for the first one.
+ *
+ * Positions whose expected character is not printable ASCII are not
+ * counted.
+ */
+static void
+key_stats_add(struct key_stats* s,
+              const struct glyph_table* g,
+              size_t i,
+              uint32_t ch,
+              uint64_t dt_ns);
+
+/**
+ * usage - Print program usage.
+ * @progname: The program name.
+ *
+ * Sends the program usage details to stderr.
+ */
+static void
+usage(char* progname);
+
+/**
+ * Construct directory from path.
+ *
+ * This takes all directory components including parent dirs and constructs one
+ * from a given path argument.
+ *
+ * @path - The path to construct the directory from.
+ *
+ * Returns the status code of the create directories operation where != 0 is
+ * err.
+ */
+static int
+__create_directories(const char* path);
+
+/**
+ * draw_results - Draw results screen.
+ *
+ * @wpm: Words per minute.
+ * @cpm: Characters per minute.
+ * @accuracy: Accuracy in percentage.
+ * @consistency: Consistency in percentage.
+ * @lat: Latency statistics of the session.
+ */
+static void
+draw_results(double wpm,
+             double cpm,
+             double accuracy,
+             double consistency,
+             const struct latency_stats* lat);
+
+/**
+ * draw_heatmap - Draw a keyboard coloured by the all-time miss rate of each
+ * key, from the keystroke profile, with the worst bigrams underneath.
+ * @row: Top row of the keyboard.
+ *
+ * Used by --heatmap. Does nothing if the profile is not open.
+ */
+static void
+draw_heatmap(int row);
+
+/* scores file (prefixed by $HOME) */
+static const char* scores_file = ".local/state/typc/data.csv";
+
+/* Absolute path of the scores file, resolved once by create_data_csv */
+static char scores_path[PATH_MAX];
+
+/* The scores file, held open for the whole process */
+static FILE* scores_fp = NULL;
+
+/* 0 until state_open runs, then its result: 1 on success, -1 on failure */
+static int state_status = 0;
+
+/* Binary score store (prefixed by $HOME) */
+static const char* store_file = ".local/state/typc/scores.bin";
+
+/* Keystroke profile (prefixed by $HOME) */
+static const char* profile_name = ".local/state/typc/profile.bin";
+
+/* The keystroke profile of this process, see profile_open */
+static struct profile_file* key_profile = NULL;
+static int profile_fd = -1;
+
+/* Set by --heatmap */
+static int heatmap_mode = 0;
+
+/* The binary score store of this process, see score_store_open */
+static struct
+{
+  char path[PATH_MAX];
+  int fd;
+} score_store = { "", -1 };
+
+/* Set by --stats */
+static int stats_mode = 0;
+
+/* CSV file given to --stats, if any */
+static const char* stats_csv = NULL;
+
+/* When in 'tty mode' (teletype mode) where text is scrolling, this is the
+ * amount of characters that are shown from the position of the current cursor
+ * to the position of the end of the screen.
+ */
+static int char_offset = 20;
+
+/* Can be modified with --debug */
+static int debug = 0;
+
+/* Home dir value. Used for saving to csv files and other stuff. Needs to be
+ * static as it's accessed by multiple other static functions */
+static char* home_dir;
+
+/* Renderer of the display mode, render_wrapped with --wrap */
+static render_fn* render_frame = render_scrolled;
+
+/* Set by --build-corpus */
+static int build_corpus_mode = 0;
+
+/* Number of rounds to run, set by --rounds; 0 (--endless) runs until quit */
+static int rounds = 1;
+
+/* Set by --adaptive */
+static int adaptive_mode = 0;
+
+/* Seconds of a --time test and words of a --words test; either one makes
+ * the rounds text streams (stream_mode) */
+static int time_limit = 0;
+static int word_limit = 0;
+static int stream_mode = 0;
+
+/* Weak spots of the user, see weakness_update */
+static struct weakness weak_profile;
+
+/* File given to --record, see record_open */
+static FILE* record_fp = NULL;
+
+/* Files given to --record and --replay */
+static const char* record_path = NULL;
+static const char* replay_path = NULL;
+
+/* Directory given to --batch */
+static const char* batch_dir = NULL;
+
+/* File given to --trace */
+static const char* trace_path = NULL;
+
+/* Ring of the last TRACE_CAP spans, NULL unless tracing (see trace_open) */
+static struct trace_span* trace_ring = NULL;
+
+/* Spans recorded so far; the next goes to trace_ring[trace_len % TRACE_CAP] */
+static uint64_t trace_len = 0;
+
+/* Sockets given to --serve and --join */
+static const char* serve_path = NULL;
+static const char* join_path = NULL;
+
+/* Connection of --join; race.fd is -1 unless racing */
+static struct race_conn race = { .fd = -1 };
+
+/**
+ * main - Entry point for the typing trainer program.
+ *
+ * Reads a random text file from the ENTRIES_DIR directory and launches the
+ * typing trainer. A "--wrap" argument enables text wrapping mode. With
+ * "--rounds N" or "--endless" further texts follow in the same process.
+ * Returns 0 on success, or a non-zero value on error.
+ */
+int
+main(int argc, char** argv)
+{
+  static struct session_bufs sb;
+  struct text_choice choices[2], *cur;
+  struct startup_job job;
+  struct arena arenas[2];
+  struct corpus corpus;
+  int have_corpus = 0;
+  int round, last, ch;
+  uint64_t t;
+
+  parse_args(argc, argv);
+  if (trace_path != NULL && trace_open() != 0) {
+    return 1;
+  }
+
+  if (build_corpus_mode == 1) {
+    return build_corpus(ENTRIES_DIR, CORPUS_FILE) == 0 ? 0 : 1;
+  }
+  if (stats_mode == 1 && stats_csv != NULL) {
+    return print_csv_stats(stats_csv) == 0 ? 0 : 1;
+  }
+  if (stats_mode == 1) {
+    return print_stats() == 0 ? 0 : 1;
+  }
+  if (replay_path != NULL) {
+    return replay(replay_path) == 0 ? 0 : 1;
+  }
+  if (batch_dir != NULL) {
+    return batch_replay(batch_dir) == 0 ? 0 : 1;
+  }
+  if (serve_path != NULL) {
+    return serve_races(serve_path) == 0 ? 0 : 1;
+  }
+
+  seed_rng();
+
+  /* Texts and keys are in the locale's encoding, and only LC_CTYPE is set so
+   * that numbers in the scores stay in C format. It is set before any thread
+   * is started, as setlocale must not run alongside the startup worker. */
+  (void)setlocale(LC_CTYPE, "");
+
+  /* The state files are otherwise opened by startup_text (see state_open). */
+  if (adaptive_mode == 1 || debug == 1 || join_path != NULL) {
+    t = trace_begin();
+    if (state_open() != 0) {
+      state_warn();
+      return 1;
+    }
+    trace_end("state open", t);
+  }
+  if (record_path != NULL && record_open(record_path) != 0) {
+    return 1;
+  }
+
+  if (join_path != NULL) {
+    last = race_join(join_path, &sb);
+    session_bufs_free(&sb);
+    if (record_fp != NULL) {
+      fclose(record_fp);
+    }
+    return last == 0 ? 0 : 1;
+  }
+
+  /* Round n uses choices[n & 1] and arenas[n & 1], so the next text can be
+   * picked while the current one is still on screen. A stream picks its own
+   * texts as it goes. */
+  memset(arenas, 0, sizeof(arenas));
+  memset(choices, 0, sizeof(choices));
+  memset(&job, 0, sizeof(job));
+  job.corpus = &corpus;
+  job.arena = &arenas[1];
+  job.choice = &choices[1];
+
+  /* Open the corpus and choose the first text while ncurses comes up, where
+   * there is a second core. With --debug they run first and in order, so
+   * that the messages stay readable. ncurses and the corpus mapping stay up
+   * for all rounds, and stderr is held until ncurses ends. */
+  t = trace_begin();
+  if (debug == 1) {
+    startup_text(&job);
+    stderr_hold();
+    startup_worker(&job, 0, 2);
+  } else {
+    stderr_hold();
+    (void)run_workers(2, startup_worker, &job);
+  }
+  have_corpus = job.have_corpus;
+  trace_add("corpus load", 2, job.t_begin, job.t_corpus);
+  trace_add("select text", 2, job.t_corpus, job.t_text);
+  trace_add("state open", 2, job.t_text, job.t_end);
+  trace_end("startup", t);
+  if (job.ret != 0 || job.state != 0) {
+    (void)endwin();
+    stderr_release();
+    if (job.ret != 0) {
+      fprintf(stderr, "Error: no text to type\n");
+    }
+    if (job.state != 0) {
+      state_warn();
+    }
+    arena_free(&arenas[1]);
+    if (have_corpus == 1) {
+      corpus_close(&corpus);
+    }
+    return 1;
+  }
+
+  for (round = 1;; round++) {
+    last = rounds > 0 && round >= rounds;
+    if (stream_mode == 1) {
+      arena_reset(&arenas[round & 1]);
+      if (run_stream_round(
+            &sb, have_corpus ? &corpus : NULL, &arenas[round & 1]) != 0) {
+        last = 1;
+      }
+    } else {
+      cur = &choices[round & 1];
+      run_typing_trainer(
+        &sb, cur->path, cur->id, cur->text, &cur->metrics, NULL);
+    }
+
+    /* Pick and prefetch the next text while the results are read. */
+    if (!last && stream_mode == 0) {
+      arena_reset(&arenas[(round + 1) & 1]);
+      t = trace_begin();
+      if (choose_text(have_corpus ? &corpus : NULL,
+                      &arenas[(round + 1) & 1],
+                      &choices[(round + 1) & 1]) != 0) {
+        last = 1;
+      }
+      trace_end("select text", t);
+    }
+
+    ch = wait_results(last);
+    if (last || ch == 'q') {
+      break;
+    }
+  }
+  (void)endwin();
+  stderr_release();
+
+  session_bufs_free(&sb);
+  arena_free(&arenas[0]);
+  arena_free(&arenas[1]);
+  if (have_corpus == 1) {
+    corpus_close(&corpus);
+  }
+  if (record_fp != NULL) {
+    fclose(record_fp);
+  }
+  return 0;
+}
+
+int
+choose_text(const struct corpus* corpus,
+            struct arena* a,
+            struct text_choice* c)
+{
+  const char* name;
+  char *rand_file, *text;
+
+  memset(c, 0, sizeof(*c));
+  c->entry = CORPUS_NONE;
+
+  if (corpus != NULL) {
+    c->entry = pick_entry(corpus);
+    if (corpus_get(corpus, c->entry, a, &name, &c->text, &c->metrics) != 0) {
+      fprintf(stderr, "Error: corrupt corpus %s\n", CORPUS_FILE);
+      return -1;
+    }
+    snprintf(c->path, sizeof(c->path), "%s/%s", ENTRIES_DIR, name);
+    c->id = corpus->entries[c->entry].id;
+    if (debug == 1) {
+      fprintf(stderr, "[debug] using %s from %s\n", c->path, CORPUS_FILE);
+    }
+    return 0;
+  }
+
+  rand_file = select_random_file(a);
+  if (!rand_file) {
+    perror("random_file_from_dir");
+    return -1;
+  }
+
+  snprintf(c->path, sizeof(c->path), "%s/%s", ENTRIES_DIR, rand_file);
+  if (debug == 1) {
+    fprintf(stderr, "[debug] reading %s\n", c->path);
+  }
+  text = read_file(c->path, a);
+  if (!text) {
+    perror("read_file");
+    return -1;
+  }
+  /* Texts straight from the directory get what build_corpus does to them. */
+  c->id = hash_text(text, text_normalise(text));
+  c->text = text;
+  text_metrics_init(&c->metrics, c->text);
+  return 0;
+}
+
+void
+startup_text(struct startup_job* job)
+{
+  /* Prefer the packed corpus; fall back to ENTRIES_DIR if it has not been
+   * built or texts were added or removed since. */
+  job->t_begin = trace_begin();
+  job->have_corpus = corpus_open_current(job->corpus) == 0;
+  job->t_corpus = trace_begin();
+  if (stream_mode == 0) {
+    job->ret = choose_text(
+      job->have_corpus ? job->corpus : NULL, job->arena, job->choice);
+  }
+  job->t_text = trace_begin();
+  job->state = state_open();
+  job->t_end = trace_begin();
+}
+
+void
+startup_worker(void* ctx, size_t w, size_t n)
+{
+  struct startup_job* job = ctx;
+  uint64_t t;
+
+  /* Shard 0 runs on the calling thread, so it may record its own span. */
+  if (w == 0) {
+    t = trace_begin();
+    __init_ncurses();
+    trace_end("ncurses init", t);
+  }
+  if (w == n - 1) {
+    startup_text(job);
+  }
+}
+
+int
+__create_directories(const char* path)
+{
+  char tmp[PATH_MAX];
+  size_t len;
+  char* p;
+
+  len = strlen(path);
+  if (len >= sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    perror("mkdir");
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  memcpy(tmp, path, len + 1);
+  /* Remove trailing slash, if any. */
+  if (tmp[len - 1] == '/') {
+    tmp[len - 1] = '\0';
+  }
+  /* Create each directory component in the path. */
+  for (p = tmp + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+      }
+      *p = '/';
+    }
+  }
+
+  /* Create the final directory. */
+  if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+    perror("mkdir");
+    return -1;
+  }
+  return 0;
+}
+
+int
+create_data_csv(void)
+{
+  char* last_slash;
+
+  home_dir = getenv("HOME");
+  if (home_dir == NULL) {
+    fprintf(stderr, "Error: HOME environment variable is not set.\n");
+    return -1;
+  }
+
+  /* construct path */
+  snprintf(scores_path, sizeof(scores_path), "%s/%s", home_dir, scores_file);
+
+  /* Create the parent directories by cutting the path at its file name. */
+  last_slash = strrchr(scores_path, '/');
+  if (last_slash != NULL) {
+    *last_slash = '\0';
+    if (__create_directories(scores_path) != 0) {
+      *last_slash = '/';
+      return -1;
+    }
+    *last_slash = '/';
+  }
+
+  scores_fp = fopen(scores_path, "a");
+  if (scores_fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  (void)atexit(close_data_csv);
+
+  if (debug == 1) {
+    fprintf(stderr, "[debug] Opened scores file: %s\n", scores_path);
+  }
+  return 0;
+}
+
+void
+close_data_csv(void)
+{
+  if (scores_fp == NULL) {
+    return;
+  }
+  if (fflush(scores_fp) != 0 || fsync(fileno(scores_fp)) != 0) {
+    perror("Error saving scores");
+  }
+  if (fclose(scores_fp) != 0) {
+    perror("Error closing scores file");
+  }
+  scores_fp = NULL;
+}
+
+int
+state_open(void)
+{
+  if (state_status != 0) {
+    return state_status > 0 ? 0 : -1;
+  }
+  state_status = -1;
+  if (create_data_csv() == 0) {
+    state_status = 1;
+    (void)score_store_open();
+    (void)profile_open();
+    if (adaptive_mode == 1) {
+      weakness_seed(&weak_profile, scores_path);
+    }
+  }
+  return state_status > 0 ? 0 : -1;
+}
+
+void
+state_warn(void)
+{
+  if (state_status < 0) {
+    fprintf(stderr,
+            "Failed to create data csv path %s/%s; scores cannot be saved\n",
+            home_dir ? home_dir : "$HOME",
+            scores_file);
+  }
+}
+
+char*
+read_file(const char* path, struct arena* a)
+{
+  char* buffer = NULL; /* file buffer */
+  struct stat st;      /* file length */
+  size_t done = 0;
+  ssize_t n;
+  int fd = open(path, O_RDONLY);
+
+  /* Plain descriptors rather than stdio, so that reading a text allocates
+   * nothing beyond @buffer. */
+  if (fd < 0) {
+    if (debug) {
+      fprintf(stderr, "Error reading %s\n", path);
+    }
+    perror("open");
+    return NULL;
+  }
+
+  if (fstat(fd, &st) != 0) {
+    perror("Error getting file length");
+    close(fd);
+    return NULL;
+  }
+
+  /* Allocate extra byte for null terminator */
+  buffer = a ? arena_alloc(a, (size_t)st.st_size + 1)
+             : malloc((size_t)st.st_size + 1);
+  if (!buffer) {
+    perror("Error allocating buffer");
+    close(fd);
+    return NULL;
+  }
+
+  while (done < (size_t)st.st_size) {
+    n = read(fd, buffer + done, (size_t)st.st_size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("Error reading file");
+      if (!a) {
+        free(buffer);
+      }
+      close(fd);
+      return NULL;
+    }
+    done += (size_t)n;
+  }
+  buffer[done] = '\0';
+
+  if (close(fd) != 0) {
+    perror("Error closing file");
+    if (!a) {
+      free(buffer);
+    }
+    return NULL;
+  }
+
+  return buffer;
+}
+
+/* qsort comparator for build_corpus */
+static int
+cmp_names(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* corpus_key - Content hash of one text of build_corpus, for finding
+ * duplicates. */
+struct corpus_key
+{
+  uint64_t id;
+  size_t idx;
+};
+
+/* qsort comparator for build_corpus: by hash, then in name order */
+static int
+cmp_corpus_keys(const void* a, const void* b)
+{
+  const struct corpus_key *x = a, *y = b;
+
+  if (x->id != y->id) {
+    return x->id < y->id ? -1 : 1;
+  }
+  return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* corpus_job - Shared state of corpus_worker; entry i of each array is only
+ * written by the worker that owns it. */
+struct corpus_job
+{
+  const char* dir;
+  char** names;
+  size_t count;
+  char** texts;
+  struct corpus_entry* entries;
+  uint8_t* feats;
+  const unsigned char* dict;
+  size_t dict_len;
+};
+
+/* corpus_worker - Read and analyse one shard of the texts of build_corpus. */
+static void
+corpus_worker(void* ctx, size_t w, size_t n)
+{
+  struct corpus_job* job = ctx;
+  struct corpus_entry* e;
+  struct text_metrics m;
+  char path[PATH_MAX];
+  size_t i;
+
+  for (i = w; i < job->count; i += n) {
+    snprintf(path, sizeof(path), "%s/%s", job->dir, job->names[i]);
+    job->texts[i] = read_file(path, NULL);
+    if (!job->texts[i]) {
+      continue;
+    }
+    e = &job->entries[i];
+    e->id = hash_text(job->texts[i], text_normalise(job->texts[i]));
+    text_metrics_init(&m, job->texts[i]);
+    e->text_len = m.bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)m.bytes;
+    e->chars = (uint32_t)m.chars;
+    e->non_space = (uint32_t)m.non_space;
+    e->words = (uint32_t)m.words;
+    e->lines = (uint32_t)m.lines;
+    e->longest_word = (uint32_t)m.longest_word;
+    text_features(job->texts[i], job->feats + i * FEAT_DIMS);
+  }
+}
+
+/* corpus_pack_worker - Compress one shard of the kept texts of build_corpus:
+ * texts[i] is replaced by its deflate stream, of entries[i].text_zlen bytes,
+ * which is left 0 if compressing failed. The dictionary is loaded once and
+ * the primed stream copied for each text, which is much cheaper than
+ * loading it again. */
+static void
+corpus_pack_worker(void* ctx, size_t w, size_t n)
+{
+  struct corpus_job* job = ctx;
+  struct corpus_entry* e;
+  unsigned char* out;
+  z_stream primed, zs;
+  uLong bound;
+  size_t i;
+
+  memset(&primed, 0, sizeof(primed));
+  if (deflateInit2(&primed,
+                   Z_BEST_COMPRESSION,
+                   Z_DEFLATED,
+                   -MAX_WBITS,
+                   8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return;
+  }
+  if (job->dict_len > 0 &&
+      deflateSetDictionary(&primed, job->dict, (uInt)job->dict_len) != Z_OK) {
+    (void)deflateEnd(&primed);
+    return;
+  }
+  for (i = w; i < job->count; i += n) {
+    e = &job->entries[i];
+    if (!job->texts[i] || deflateCopy(&zs, &primed) != Z_OK) {
+      continue;
+    }
+    bound = deflateBound(&zs, e->text_len);
+    out = malloc(bound);
+    if (out) {
+      zs.next_in = (Bytef*)job->texts[i];
+      zs.avail_in = e->text_len;
+      zs.next_out = out;
+      zs.avail_out = (uInt)bound;
+      if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+        free(job->texts[i]);
+        job->texts[i] = (char*)out;
+        e->text_zlen = (uint32_t)zs.total_out;
+      } else {
+        free(out);
+      }
+    }
+    (void)deflateEnd(&zs);
+  }
+  (void)deflateEnd(&primed);
+}
+
+/* dict_seg - A segment of the corpus chosen by corpus_dict. */
+struct dict_seg
+{
+  uint64_t score;
+  size_t off;
+};
+
+/* qsort comparator for corpus_dict: by score, lowest first */
+static int
+cmp_dict_segs(const void* a, const void* b)
+{
+  const struct dict_seg *x = a, *y = b;
+
+  if (x->score != y->score) {
+    return x->score < y->score ? -1 : 1;
+  }
+  return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/* dmer_hash - Slot of the CORPUS_DICT_DMER bytes at @p in the d-mer tables
+ * of corpus_dict. */
+static uint32_t
+dmer_hash(const unsigned char* p)
+{
+  uint64_t v = 0;
+  int k;
+
+  for (k = 0; k < CORPUS_DICT_DMER; k++) {
+    v = (v << 8) | p[k];
+  }
+  v *= 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(v >> (64 - CORPUS_DICT_HASH_BITS));
+}
+
+/**
+ * corpus_dict - Train the preset dictionary of a corpus.
+ * @texts: The texts, NULL for the ones left out.
+ * @entries: Their entries, for the lengths.
+ * @count: Number of texts.
+ * @dict: Set to the dictionary, CORPUS_DICT_MAX bytes.
+ *
+ * This is the cover algorithm of zstd's dictionary builder on a small scale.
+ * The texts, taken end to end, are split into one epoch per segment of the
+ * dictionary. From each epoch the CORPUS_DICT_SEG bytes whose distinct
+ * d-mers occur most often in the whole corpus are taken, after which those
+ * d-mers count for nothing, so that later segments bring something new. The
+ * best segments go last, closest to the text, where deflate refers to them
+ * most cheaply. A corpus of less than eight bytes of text per byte of
+ * dictionary gets a smaller one.
+ *
+ * Returns the length of the dictionary, 0 if none could be trained.
+ */
+static size_t
+corpus_dict(char* const* texts,
+            const struct corpus_entry* entries,
+            size_t count,
+            unsigned char* dict)
+{
+  const size_t win = CORPUS_DICT_SEG - CORPUS_DICT_DMER + 1;
+  unsigned char* cat = NULL;
+  uint32_t* freq = NULL;
+  uint8_t* seen = NULL;
+  struct dict_seg* segs = NULL;
+  size_t total = 0, nsegs, epoch, n, i, j, end, len = 0;
+  uint64_t score;
+  uint32_t h;
+
+  for (n = 0; n < count; n++) {
+    total += texts[n] ? entries[n].text_len : 0;
+  }
+  nsegs = (total / 8 < CORPUS_DICT_MAX ? total / 8 : CORPUS_DICT_MAX) /
+          CORPUS_DICT_SEG;
+  if (nsegs == 0) {
+    return 0;
+  }
+
+  /* freq counts each d-mer over the corpus, seen within the window. */
+  cat = malloc(total);
+  freq = calloc((size_t)1 << CORPUS_DICT_HASH_BITS, sizeof(*freq));
+  seen = calloc((size_t)1 << CORPUS_DICT_HASH_BITS, sizeof(*seen));
+  segs = calloc(nsegs, sizeof(*segs));
+  if (!cat || !freq || !seen || !segs) {
+    perror("calloc");
+    goto out;
+  }
+  for (n = 0, i = 0; n < count; n++) {
+    if (texts[n]) {
+      memcpy(cat + i, texts[n], entries[n].text_len);
+      i += entries[n].text_len;
+    }
+  }
+  for (i = 0; i + CORPUS_DICT_DMER <= total; i++) {
+    freq[dmer_hash(cat + i)]++;
+  }
+
+  epoch = total / nsegs;
+  for (n = 0; n < nsegs; n++) {
+    /* Slide a window of the d-mers of one segment over the epoch. */
+    end = (n + 1) * epoch;
+    end = end + CORPUS_DICT_DMER <= total ? end : total - CORPUS_DICT_DMER + 1;
+    segs[n].off = n * epoch;
+    score = 0;
+    for (i = n * epoch; i < end; i++) {
+      h = dmer_hash(cat + i);
+      if (seen[h]++ == 0) {
+        score += freq[h];
+      }
+      if (i + 1 - n * epoch < win) {
+        continue;
+      }
+      if (score > segs[n].score) {
+        segs[n].score = score;
+        segs[n].off = i + 1 - win;
+      }
+      h = dmer_hash(cat + i + 1 - win);
+      if (--seen[h] == 0) {
+        score -= freq[h];
+      }
+    }
+    for (j = i > n * epoch + win ? i + 1 - win : n * epoch; j < i; j++) {
+      seen[dmer_hash(cat + j)] = 0;
+    }
+    for (j = 0; j < win; j++) {
+      freq[dmer_hash(cat + segs[n].off + j)] = 0;
+    }
+  }
+
+  qsort(segs, nsegs, sizeof(*segs), cmp_dict_segs);
+  for (n = 0; n < nsegs; n++) {
+    if (segs[n].score > 0) {
+      memcpy(dict + len, cat + segs[n].off, CORPUS_DICT_SEG);
+      len += CORPUS_DICT_SEG;
+    }
+  }
+
+out:
+  free(cat);
+  free(freq);
+  free(seen);
+  free(segs);
+  return len;
+}
+
+int
+build_corpus(const char* dir, const char* out)
+{
+  char** names = NULL;
+  size_t count = 0, n, k, kept, nkeys;
+  struct corpus_entry* entries = NULL;
+  struct corpus_key* keys = NULL;
+  uint8_t* feats = NULL;
+  char** texts = NULL;
+  struct corpus_job job;
+  struct corpus_header hdr;
+  struct timespec mtime;
+  char tmp_path[PATH_MAX];
+  unsigned char* dict = NULL;
+  size_t dict_len;
+  FILE* fp = NULL;
+  uint64_t off;
+  int ret = -1;
+
+  /* Take the mtime first: a change made while packing leaves the corpus
+   * looking stale rather than fresh. */
+  if (dir_mtime(dir, &mtime) != 0) {
+    perror("stat");
+    return -1;
+  }
+
+  names = list_texts(dir, &count);
+  if (!names) {
+    fprintf(stderr, "Error: no texts in %s\n", dir);
+    return -1;
+  }
+
+  entries = calloc(count, sizeof(*entries));
+  feats = calloc(count, FEAT_DIMS);
+  texts = calloc(count, sizeof(*texts));
+  keys = calloc(count, sizeof(*keys));
+  if (!entries || !feats || !texts || !keys) {
+    perror("calloc");
+    goto out;
+  }
+
+  /* Reading and analysing the texts is independent per text, so it is
+   * spread over all cores; only writing the blob below is sequential. */
+  job.dir = dir;
+  job.names = names;
+  job.count = count;
+  job.texts = texts;
+  job.entries = entries;
+  job.feats = feats;
+  (void)run_workers(count, corpus_worker, &job);
+
+  /* Drop every text whose normalised content an earlier name already has;
+   * texts with equal hashes are compared in full. Dropped texts are freed
+   * and the rest keep their name order. Texts that could not be read are
+   * left out, without failing the build. */
+  for (n = 0, nkeys = 0; n < count; n++) {
+    if (!texts[n]) {
+      fprintf(stderr, "Error: cannot read %s/%s, skipping it\n", dir, names[n]);
+      continue;
+    }
+    keys[nkeys].id = entries[n].id;
+    keys[nkeys].idx = n;
+    nkeys++;
+  }
+  if (nkeys == 0) {
+    fprintf(stderr, "Error: no readable texts in %s\n", dir);
+    goto out;
+  }
+  qsort(keys, nkeys, sizeof(*keys), cmp_corpus_keys);
+  for (n = 1; n < nkeys; n++) {
+    for (k = n; k-- > 0 && keys[k].id == keys[n].id;) {
+      if (texts[keys[k].idx] &&
+          strcmp(texts[keys[k].idx], texts[keys[n].idx]) == 0) {
+        if (debug == 1) {
+          fprintf(stderr,
+                  "[debug] %s duplicates %s\n",
+                  names[keys[n].idx],
+                  names[keys[k].idx]);
+        }
+        free(texts[keys[n].idx]);
+        texts[keys[n].idx] = NULL;
+        break;
+      }
+    }
+  }
+  for (n = 0, kept = 0; n < count; n++) {
+    if (texts[n]) {
+      kept++;
+    }
+  }
+
+  /* Compress the kept texts one by one against a shared dictionary, which
+   * gives each the context that a text of a few hundred bytes lacks. */
+  dict = malloc(CORPUS_DICT_MAX);
+  if (!dict) {
+    perror("malloc");
+    goto out;
+  }
+  dict_len = corpus_dict(texts, entries, count, dict);
+  job.dict = dict;
+  job.dict_len = dict_len;
+  (void)run_workers(count, corpus_pack_worker, &job);
+
+  /* Named per process, as several may refresh a stale corpus at once. */
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", out, (long)getpid());
+  fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    perror("fopen corpus");
+    goto out;
+  }
+
+  /* Reserve room for the header, offset table, feature vectors and
+   * dictionary, then stream the blob. Kept entries move down over the
+   * dropped ones. */
+  off = sizeof(hdr) + kept * sizeof(*entries) + kept * FEAT_DIMS + dict_len;
+  if (fseek(fp, (long)off, SEEK_SET) != 0) {
+    perror("fseek corpus");
+    goto out;
+  }
+
+  for (n = 0, k = 0; n < count; n++) {
+    size_t name_len = strlen(names[n]);
+    size_t text_zlen = entries[n].text_zlen;
+
+    if (!texts[n]) {
+      continue;
+    }
+    if (text_zlen == 0) {
+      fprintf(stderr, "Error: cannot compress %s\n", names[n]);
+      goto out;
+    }
+    if (off + name_len + text_zlen + 1 > UINT32_MAX) {
+      fprintf(stderr, "Error: corpus too large\n");
+      goto out;
+    }
+    entries[k] = entries[n];
+    memmove(feats + k * FEAT_DIMS, feats + n * FEAT_DIMS, FEAT_DIMS);
+    entries[k].name_off = (uint32_t)off;
+    entries[k].name_len = (uint32_t)name_len;
+    entries[k].text_off = (uint32_t)(off + name_len + 1);
+    k++;
+    off += name_len + text_zlen + 1;
+
+    if (fwrite(names[n], 1, name_len + 1, fp) != name_len + 1 ||
+        fwrite(texts[n], 1, text_zlen, fp) != text_zlen) {
+      perror("fwrite corpus");
+      goto out;
+    }
+    free(texts[n]);
+    texts[n] = NULL;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CORPUS_MAGIC, sizeof(hdr.magic));
+  hdr.version = CORPUS_VERSION;
+  hdr.count = (uint32_t)kept;
+  hdr.index_off = sizeof(hdr);
+  hdr.size = off;
+  hdr.src_mtime_sec = (int64_t)mtime.tv_sec;
+  hdr.src_mtime_nsec = (int64_t)mtime.tv_nsec;
+  hdr.feat_off = sizeof(hdr) + kept * sizeof(*entries);
+  hdr.dict_off = hdr.feat_off + kept * FEAT_DIMS;
+  hdr.dict_len = dict_len;
+
+  if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      fwrite(entries, sizeof(*entries), kept, fp) != kept ||
+      fwrite(feats, FEAT_DIMS, kept, fp) != kept ||
+      fwrite(dict, 1, dict_len, fp) != dict_len) {
+    perror("fwrite corpus");
+    goto out;
+  }
+
+  if (fclose(fp) != 0) {
+    fp = NULL;
+    perror("fclose corpus");
+    remove(tmp_path);
+    goto out;
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, out) != 0) {
+    perror("rename corpus");
+    remove(tmp_path);
+    goto out;
+  }
+
+  if (debug == 1) {
+    fprintf(stderr,
+            "[debug] packed %zu texts into %s, %zu duplicates dropped, "
+            "%zu byte dictionary, %llu bytes\n",
+            kept,
+            out,
+            count - kept,
+            dict_len,
+            (unsigned long long)off);
+  }
+
+  /* Keep the name index used by the fallback path in sync as well. */
+  if (write_name_index(INDEX_FILE, names, count, &mtime) != 0) {
+    goto out;
+  }
+  ret = 0;
+
+out:
+  if (fp) {
+    fclose(fp);
+    remove(tmp_path);
+  }
+  for (n = 0; texts && n < count; n++) {
+    free(texts[n]);
+  }
+  free(texts);
+  free_names(names, count);
+  free(entries);
+  free(keys);
+  free(feats);
+  free(dict);
+  return ret;
+}
+
+int
+corpus_open(struct corpus* c, const char* path)
+{
+  struct stat st;
+  void* map;
+  int fd;
+
+  memset(c, 0, sizeof(*c));
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(struct corpus_header)) {
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  c->base = map;
+  c->size = (size_t)st.st_size;
+  c->hdr = map;
+
+  if (memcmp(c->hdr->magic, CORPUS_MAGIC, sizeof(c->hdr->magic)) != 0 ||
+      c->hdr->version != CORPUS_VERSION || c->hdr->count == 0 ||
+      c->hdr->size != c->size || c->hdr->index_off > c->size ||
+      (c->size - c->hdr->index_off) / sizeof(struct corpus_entry) <
+        c->hdr->count ||
+      c->hdr->feat_off > c->size ||
+      (c->size - c->hdr->feat_off) / FEAT_DIMS < c->hdr->count ||
+      c->hdr->dict_len > CORPUS_DICT_MAX || c->hdr->dict_off > c->size ||
+      c->size - c->hdr->dict_off < c->hdr->dict_len) {
+    if (debug == 1) {
+      fprintf(stderr, "[debug] ignoring invalid corpus %s\n", path);
+    }
+    corpus_close(c);
+    return -1;
+  }
+
+  c->entries = (const struct corpus_entry*)(c->base + c->hdr->index_off);
+  c->feats = c->base + c->hdr->feat_off;
+  return 0;
+}
+
+void
+corpus_close(struct corpus* c)
+{
+  if (c->base != NULL) {
+    (void)munmap((void*)c->base, c->size);
+  }
+  memset(c, 0, sizeof(*c));
+}
+
+int
+corpus_open_current(struct corpus* c)
+{
+  struct timespec mtime;
+
+  if (corpus_open(c, CORPUS_FILE) == 0) {
+    if (dir_mtime(ENTRIES_DIR, &mtime) != 0 ||
+        (c->hdr->src_mtime_sec == (int64_t)mtime.tv_sec &&
+         c->hdr->src_mtime_nsec == (int64_t)mtime.tv_nsec)) {
+      return 0;
+    }
+    if (debug == 1) {
+      fprintf(stderr,
+              "[debug] %s is stale; run typc --build-corpus\n",
+              CORPUS_FILE);
+    }
+    corpus_close(c);
+  }
+  return -1;
+}
+
+/* corpus_zalloc - zlib allocator of corpus_get, taking from the arena in
+ * @opaque. */
+static voidpf
+corpus_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  return arena_alloc(opaque, (size_t)items * size);
+}
+
+/* corpus_zfree - zlib deallocator of corpus_get; arena_release frees. */
+static void
+corpus_zfree(voidpf opaque, voidpf address)
+{
+  (void)opaque;
+  (void)address;
+}
+
+/* corpus_entry_metrics - The text_metrics stored in a corpus entry. */
+static void
+corpus_entry_metrics(const struct corpus_entry* e, struct text_metrics* m)
+{
+  m->chars = e->chars;
+  m->bytes = e->text_len;
+  m->non_space = e->non_space;
+  m->words = e->words;
+  m->lines = e->lines;
+  m->longest_word = e->longest_word;
+  m->avg_word_len = m->words ? (double)m->non_space / (double)m->words
+                             : DEF_AVG_WORDLEN;
+}
+
+int
+corpus_get(const struct corpus* c,
+           uint32_t idx,
+           struct arena* a,
+           const char** name,
+           const char** text,
+           struct text_metrics* m)
+{
+  const struct corpus_entry* e;
+  struct arena_mark mark;
+  z_stream zs;
+  char* out;
+  int ok;
+
+  if (idx >= c->hdr->count) {
+    return -1;
+  }
+  e = &c->entries[idx];
+
+  /* The name must be null-terminated and the text's stream must lie inside
+   * the mapping. */
+  if ((size_t)e->name_off + e->name_len >= c->size ||
+      (size_t)e->text_off + e->text_zlen > c->size ||
+      c->base[e->name_off + e->name_len] != '\0') {
+    return -1;
+  }
+
+  out = arena_alloc(a, (size_t)e->text_len + 1);
+  if (!out) {
+    return -1;
+  }
+  mark = arena_save(a);
+  memset(&zs, 0, sizeof(zs));
+  zs.zalloc = corpus_zalloc;
+  zs.zfree = corpus_zfree;
+  zs.opaque = a;
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+    arena_release(a, &mark);
+    return -1;
+  }
+  /* One byte more than the text, so that a stream that inflates to more
+   * is caught rather than cut short. */
+  zs.next_in = (Bytef*)(c->base + e->text_off);
+  zs.avail_in = e->text_zlen;
+  zs.next_out = (Bytef*)out;
+  zs.avail_out = e->text_len + 1;
+  ok = (c->hdr->dict_len == 0 ||
+        inflateSetDictionary(&zs,
+                             c->base + c->hdr->dict_off,
+                             (uInt)c->hdr->dict_len) == Z_OK) &&
+       inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == e->text_len;
+  (void)inflateEnd(&zs);
+  arena_release(a, &mark);
+  if (!ok) {
+    return -1;
+  }
+  out[e->text_len] = '\0';
+
+  *name = (const char*)c->base + e->name_off;
+  *text = out;
+  corpus_entry_metrics(e, m);
+  return 0;
+}
+
+int
+feat_char(int c)
+{
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a';
+  }
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= '0' && c <= '9') {
+    return FEAT_DIGIT;
+  }
+  if (c > ' ' && c <= PRINT_CHAR_MAX) {
+    return FEAT_PUNCT;
+  }
+  return -1;
+}
+
+int
+feat_bigram(int a, int b)
+{
+  if (a <= ' ' || a > PRINT_CHAR_MAX || b <= ' ' || b > PRINT_CHAR_MAX) {
+    return -1;
+  }
+  return FEAT_BIGRAM +
+         (int)(((unsigned)tolower(a) * 31u + (unsigned)tolower(b)) %
+               FEAT_BIGRAM_BUCKETS);
+}
+
+void
+text_features(const char* s, uint8_t* feat)
+{
+  uint32_t counts[FEAT_DIMS] = { 0 };
+  uint32_t nchars = 0, nbigrams = 0, share;
+  const unsigned char* p = (const unsigned char*)s;
+  int d;
+
+  for (; *p; p++) {
+    if ((d = feat_char(*p)) >= 0) {
+      counts[d]++;
+      nchars++;
+    }
+    if (p[1] && (d = feat_bigram(p[0], p[1])) >= 0) {
+      counts[d]++;
+      nbigrams++;
+    }
+  }
+
+  /* Store each count as its share of the text, with 1/8 mapping to 255. */
+  for (d = 0; d < FEAT_DIMS; d++) {
+    share = d < FEAT_BIGRAM ? nchars : nbigrams;
+    share = share ? (uint32_t)(((uint64_t)counts[d] * 8 * 255) / share) : 0;
+    feat[d] = (uint8_t)(share > 255 ? 255 : share);
+  }
+}
+
+void
+weakness_update(struct weakness* w,
+                const struct glyph_table* g,
+                const struct key_log* log,
+                const struct latency_stats* lat)
+{
+  float seen[FEAT_DIMS] = { 0 }, bad[FEAT_DIMS] = { 0 };
+  float rate[FEAT_DIMS] = { 0 };
+  const struct key_event* e;
+  double mean;
+  size_t k, b;
+  int d;
+
+  /* Error rate per character class, from the keys as they were pressed
+   * (errors later fixed with backspace still count). */
+  for (k = 0; k < log->len; k++) {
+    e = &log->ev[k];
+    if (e->ch < PRINT_CHAR_MIN || e->ch > PRINT_CHAR_MAX ||
+        e->index >= g->n || (d = feat_char((int)g->cp[e->index])) < 0) {
+      continue;
+    }
+    seen[d]++;
+    if ((uint32_t)e->ch != g->cp[e->index]) {
+      bad[d]++;
+    }
+  }
+  for (d = 0; d < FEAT_BIGRAM; d++) {
+    if (seen[d] > 0) {
+      rate[d] = FEAT_ERROR_WEIGHT * bad[d] / seen[d];
+    }
+  }
+
+  /* How much slower than the session mean each bigram bucket is. */
+  if (lat->mean_us > 0.0) {
+    for (b = 0; b < BIGRAM_CHARS * BIGRAM_CHARS; b++) {
+      if (lat->bigram_n[b] == 0 ||
+          (d = feat_bigram((int)(b / BIGRAM_CHARS) + PRINT_CHAR_MIN,
+                           (int)(b % BIGRAM_CHARS) + PRINT_CHAR_MIN)) < 0) {
+        continue;
+      }
+      mean = (double)lat->bigram_us[b] / lat->bigram_n[b];
+      if (mean > lat->mean_us) {
+        bad[d] += (float)((mean / lat->mean_us - 1.0) * lat->bigram_n[b]);
+      }
+      seen[d] += (float)lat->bigram_n[b];
+    }
+    for (d = FEAT_BIGRAM; d < FEAT_DIMS; d++) {
+      if (seen[d] > 0) {
+        rate[d] = bad[d] / seen[d];
+      }
+    }
+  }
+
+  /* Older sessions fade out. */
+  for (d = 0; d < FEAT_DIMS; d++) {
+    w->w[d] = 0.5f * w->w[d] + rate[d];
+  }
+  w->sessions++;
+}
+
+void
+weakness_seed(struct weakness* w, const char* path)
+{
+  char buf[FEAT_SEED_BYTES + 1];
+  char *line, *p, *next;
+  struct stat st;
+  unsigned a, b;
+  ssize_t got;
+  off_t from;
+  int fd, field, d;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return;
+  }
+  from = st.st_size > FEAT_SEED_BYTES ? st.st_size - FEAT_SEED_BYTES : 0;
+  got = pread(fd, buf, FEAT_SEED_BYTES, from);
+  close(fd);
+  if (got <= 0) {
+    return;
+  }
+  buf[got] = '\0';
+
+  /* Skip the first, probably partial, line unless reading from the start. */
+  line = buf;
+  if (from > 0 && (line = strchr(buf, '\n')) != NULL) {
+    line++;
+  }
+  for (; line && *line; line = next) {
+    next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    }
+    /* The slow bigrams are the ninth column. */
+    for (p = line, field = 0; field < 8 && (p = strchr(p, ',')) != NULL;
+         field++) {
+      p++;
+    }
+    if (p == NULL) {
+      continue;
+    }
+    while (sscanf(p, "%2x%2x", &a, &b) == 2) {
+      if ((d = feat_bigram((int)a, (int)b)) >= 0) {
+        w->w[d] += 1.0f;
+      }
+      if ((p = strchr(p, '|')) == NULL) {
+        break;
+      }
+      p++;
+    }
+    w->sessions++;
+  }
+}
+
+uint32_t
+pick_entry(const struct corpus* c)
+{
+  uint32_t count = c->hdr->count;
+  uint32_t top[FEAT_TOP];
+  float top_score[FEAT_TOP];
+  uint32_t idx, best, k, n, ntop = 0, low = 0, j;
+  const uint8_t* f;
+  float score, total = 0.0f, r;
+  uint64_t start = 0;
+  int d;
+
+  if (adaptive_mode == 0 || c->feats == NULL || weak_profile.sessions == 0) {
+    return (uint32_t)rand() % count;
+  }
+  if (debug == 1) {
+    start = now_ns();
+  }
+
+  /* Score a random sample rather than the whole corpus, which keeps the cost
+   * constant. */
+  n = count < FEAT_CANDIDATES ? count : FEAT_CANDIDATES;
+  for (k = 0; k < n; k++) {
+    idx = n == count ? k : (uint32_t)rand() % count;
+    f = c->feats + (size_t)idx * FEAT_DIMS;
+    score = 0.0f;
+    for (d = 0; d < FEAT_DIMS; d++) {
+      score += weak_profile.w[d] * f[d];
+    }
+    for (j = 0; j < ntop && top[j] != idx; j++)
+      ;
+    if (j < ntop) {
+      continue;
+    }
+    /* Keep the FEAT_TOP best, replacing the lowest once full. */
+    if (ntop < FEAT_TOP) {
+      j = ntop++;
+    } else if (score > top_score[low]) {
+      j = low;
+    } else {
+      continue;
+    }
+    top[j] = idx;
+    top_score[j] = score;
+    for (low = 0, j = 1; j < ntop; j++) {
+      if (top_score[j] < top_score[low]) {
+        low = j;
+      }
+    }
+  }
+
+  for (j = 0; j < ntop; j++) {
+    total += top_score[j];
+  }
+  best = top[(uint32_t)rand() % ntop];
+  if (total > 0.0f) {
+    r = (float)rand() / ((float)RAND_MAX + 1.0f) * total;
+    for (j = 0; j + 1 < ntop && r >= top_score[j]; j++) {
+      r -= top_score[j];
+    }
+    best = top[j];
+  }
+
+  if (debug == 1) {
+    fprintf(stderr,
+            "[debug] adaptive pick %u of %u candidates in %.1f us\n",
+            best,
+            n,
+            (double)(now_ns() - start) / 1000.0);
+  }
+  return best;
+}
+
+void
+text_metrics_init(struct text_metrics* m, const char* s)
+{
+  const char* start = s;
+  size_t word_len = 0;
+  uint32_t cp;
+
+  memset(m, 0, sizeof(*m));
+
+  if (s == NULL) {
+    m->avg_word_len = DEF_AVG_WORDLEN;
+    return;
+  }
+
+  while (*s) {
+    s += utf8_glyph(s, &cp);
+    m->chars++;
+    if (cp < 0x80 && isspace((int)cp)) {
+      if (word_len > 0) {
+        m->words++;
+        word_len = 0;
+      }
+      if (cp == '\n') {
+        m->lines++;
+      }
+    } else {
+      m->non_space++;
+      if (++word_len > m->longest_word) {
+        m->longest_word = word_len;
+      }
+    }
+  }
+
+  if (word_len > 0) {
+    m->words++;
+  }
+  m->bytes = (size_t)(s - start);
+  if (m->bytes > 0 && s[-1] != '\n') {
+    m->lines++;
+  }
+  m->avg_word_len =
+    m->words ? (double)m->non_space / (double)m->words : DEF_AVG_WORDLEN;
+}
+
+void
+text_metrics_add(struct text_metrics* m,
+                 const char* s,
+                 size_t n,
+                 size_t* word)
+{
+  size_t i, len, word_len = word ? *word : 0;
+  uint32_t cp;
+
+  for (i = 0; i < n; i += len) {
+    len = utf8_glyph(s + i, &cp);
+    m->chars++;
+    if (cp < 0x80 && isspace((int)cp)) {
+      word_len = 0;
+      continue;
+    }
+    m->non_space++;
+    if (word_len++ == 0) {
+      m->words++;
+    }
+    if (word_len > m->longest_word) {
+      m->longest_word = word_len;
+    }
+  }
+  if (word) {
+    *word = word_len;
+  }
+  m->bytes += n;
+  m->lines = 1;
+  m->avg_word_len =
+    m->words ? (double)m->non_space / (double)m->words : DEF_AVG_WORDLEN;
+}
+
+size_t
+utf8_decode(const unsigned char* s, uint32_t* cp)
+{
+  uint32_t c = s[0], min;
+  size_t len, i;
+
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+  if (c >= 0xc2 && c <= 0xdf) {
+    len = 2;
+    c &= 0x1f;
+    min = 0x80;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    c &= 0x0f;
+    min = 0x800;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    c &= 0x07;
+    min = 0x10000;
+  } else {
+    *cp = s[0];
+    return 1;
+  }
+  /* A null terminator is not a continuation byte, so this stops there. */
+  for (i = 1; i < len; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      *cp = s[0];
+      return 1;
+    }
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+  if (c < min || c > CODE_POINT_MAX || (c >= 0xd800 && c <= 0xdfff)) {
+    *cp = s[0];
+    return 1;
+  }
+  *cp = c;
+  return len;
+}
+
+/* combining_mark - Whether @cp combines with the character before it. */
+static int
+combining_mark(uint32_t cp)
+{
+  return (cp >= 0x0300 && cp <= 0x036f) || (cp >= 0x1ab0 && cp <= 0x1aff) ||
+         (cp >= 0x1dc0 && cp <= 0x1dff) || (cp >= 0x20d0 && cp <= 0x20ff) ||
+         (cp >= 0xfe00 && cp <= 0xfe0f) || (cp >= 0xfe20 && cp <= 0xfe2f) ||
+         cp == 0x200d;
+}
+
+size_t
+utf8_glyph(const char* s, uint32_t* cp)
+{
+  const unsigned char* p = (const unsigned char*)s;
+  size_t n, k;
+  uint32_t mark;
+
+  /* Marks are never ASCII, so plain text needs no decoding at all. */
+  if (p[0] < 0x80 && p[1] < 0x80) {
+    *cp = p[0];
+    return 1;
+  }
+  n = utf8_decode(p, cp);
+  while (p[n] >= 0x80 && (k = utf8_decode(p + n, &mark)) > 1 &&
+         combining_mark(mark)) {
+    n += k;
+  }
+  return n;
+}
+
+size_t
+utf8_encode(uint32_t cp, char* out)
+{
+  if (cp < 0x80) {
+    out[0] = (char)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = (char)(0xc0 | (cp >> 6));
+    out[1] = (char)(0x80 | (cp & 0x3f));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = (char)(0xe0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[2] = (char)(0x80 | (cp & 0x3f));
+    return 3;
+  }
+  out[0] = (char)(0xf0 | (cp >> 18));
+  out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+  out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+  out[3] = (char)(0x80 | (cp & 0x3f));
+  return 4;
+}
+
+int
+key_printable(uint32_t cp)
+{
+  /* Not the C0 and C1 controls, DEL or surrogates. */
+  return cp >= PRINT_CHAR_MIN && cp != 0x7f && (cp < 0x80 || cp >= 0xa0) &&
+         (cp < 0xd800 || cp > 0xdfff) && cp <= CODE_POINT_MAX;
+}
+
+void
+glyphs_build(struct glyph_table* g, const char* text, size_t max)
+{
+  const unsigned char* p = (const unsigned char*)text;
+  uint32_t off = 0, col = 0, n = 0, cp;
+  int w;
+
+  g->text = text;
+  g->raw = 0;
+  g->ascii = 1;
+  while (n < max && p[off] != '\0') {
+    g->off[n] = off;
+    g->col[n] = col;
+    if (p[off] < ' ' || p[off] > '~') {
+      g->ascii = 0;
+    }
+    if (p[off] >= 0x80 && utf8_decode(p + off, &cp) == 1) {
+      g->raw++;
+    }
+    off += (uint32_t)utf8_glyph(text + off, &cp);
+    g->cp[n++] = cp;
+    if (cp < 0x80) {
+      col++;
+    } else {
+      w = wcwidth((wchar_t)cp);
+      col += w < 0 ? 1 : (uint32_t)w;
+    }
+  }
+  g->off[n] = off;
+  g->col[n] = col;
+  g->n = n;
+}
+
+int
+stream_open(struct text_stream* st,
+            const struct corpus* corpus,
+            struct arena* a,
+            long words)
+{
+  memset(st, 0, sizeof(*st));
+  st->buf = arena_alloc(a, STREAM_CAP + 1);
+  if (!st->buf) {
+    return -1;
+  }
+  st->corpus = corpus;
+  st->arena = a;
+  st->words_left = words;
+  st->space = 1;
+  st->done.avg_word_len = DEF_AVG_WORDLEN;
+
+  stream_fill(st);
+  if (st->len == 0) {
+    fprintf(stderr, "Error: no text to stream\n");
+    return -1;
+  }
+  text_metrics_init(&st->est, st->buf);
+  return 0;
+}
+
+void
+stream_fill(struct text_stream* st)
+{
+  uint32_t c;
+  size_t n;
+
+  while (st->len < STREAM_CAP && !st->end) {
+    if (!st->have_src) {
+      st->src_mark = arena_save(st->arena);
+      if (st->words_left == 0 ||
+          choose_text(st->corpus, st->arena, &st->src) != 0) {
+        st->end = 1;
+        break;
+      }
+      st->have_src = 1;
+      st->pos = 0;
+    }
+
+    /* The end of a text separates it from the next like a space. */
+    if (st->src.text[st->pos] == '\0') {
+      arena_release(st->arena, &st->src_mark);
+      st->have_src = 0;
+      c = ' ';
+      n = 0;
+    } else {
+      n = utf8_glyph(st->src.text + st->pos, &c);
+      if (st->len + n > STREAM_CAP) {
+        break;
+      }
+      st->pos += n;
+    }
+
+    if (c < 0x80 && isspace((int)c)) {
+      if (st->space) {
+        continue;
+      }
+      /* The space after the last word of --words is left out. */
+      if (st->words_left > 0 && --st->words_left == 0) {
+        st->end = 1;
+        break;
+      }
+      st->buf[st->len++] = ' ';
+      st->space = 1;
+    } else if (key_printable(c)) {
+      memcpy(st->buf + st->len, st->src.text + st->pos - n, n);
+      st->len += n;
+      st->space = 0;
+    }
+  }
+  st->buf[st->len] = '\0';
+}
+
+int
+stream_advance(struct text_stream* st, struct session_bufs* sb)
+{
+  const struct glyph_table* g = &sb->glyphs;
+  size_t shift, bytes;
+  int k;
+
+  if (st->end || sb->total - sb->cur >= STREAM_AHEAD) {
+    return 0;
+  }
+
+  /* Drop all but STREAM_KEEP characters behind the cursor, cutting at a
+   * space so that words stay whole. The window is counted in bytes and the
+   * cursor in glyphs. */
+  shift = sb->cur > STREAM_KEEP ? sb->cur - STREAM_KEEP : 0;
+  while (shift > 0 && g->cp[shift - 1] != ' ') {
+    shift--;
+  }
+  if (shift == 0 && st->len > STREAM_CAP - STREAM_AHEAD) {
+    /* The window is full: keep less behind the cursor, and only cut inside
+     * a word, which text_metrics_add then carries, if there is no space. */
+    for (shift = sb->cur; shift > 0 && g->cp[shift - 1] != ' '; shift--)
+      ;
+    if (shift == 0) {
+      shift = sb->cur > STREAM_KEEP ? sb->cur - STREAM_KEEP : sb->cur;
+    }
+  }
+  if (shift > 0) {
+    bytes = g->off[shift];
+    text_metrics_add(&st->done, st->buf, bytes, &st->done_word);
+    memmove(st->buf, st->buf + bytes, st->len - bytes);
+    memmove(sb->typed,
+            sb->typed + shift,
+            (sb->cur - shift) * sizeof(*sb->typed));
+    memset(sb->typed + sb->cur - shift, 0, shift * sizeof(*sb->typed));
+    st->len -= bytes;
+    sb->cur -= shift;
+    sb->base += shift;
+    for (k = 0; k < sb->roll_len; k++) {
+      sb->roll[k].cur = sb->roll[k].cur > shift ? sb->roll[k].cur - shift : 0;
+    }
+  }
+
+  stream_fill(st);
+  glyphs_build(&sb->glyphs, st->buf, STREAM_CAP);
+  sb->total = sb->glyphs.n;
+  return 1;
+}
+
+int
+run_stream_round(struct session_bufs* sb,
+                 const struct corpus* corpus,
+                 struct arena* a)
+{
+  struct text_stream st;
+  char label[32];
+
+  if (stream_open(&st, corpus, a, word_limit > 0 ? word_limit : -1) != 0) {
+    return -1;
+  }
+  if (word_limit > 0) {
+    snprintf(label, sizeof(label), "words:%d", word_limit);
+  } else {
+    snprintf(label, sizeof(label), "time:%d", time_limit);
+  }
+  run_typing_trainer(sb, label, 0, st.buf, &st.est, &st);
+  return 0;
+}
+
+void
+calc_speed(const struct text_metrics* m,
+           double elapsed,
+           double* wpm,
+           double* cpm)
+{
+  /* Count only non-whitespace characters */
+  *cpm = ((double)m->non_space / elapsed) * 60.0;
+  *wpm = *cpm / m->avg_word_len;
+}
+
+char*
+select_random_file(struct arena* a)
+{
+  const struct index_header* hdr;
+  const uint32_t* offs;
+  const char* base;
+  struct timespec mtime;
+  struct stat st;
+  char** names;
+  char* selected_file = NULL;
+  size_t count;
+  void* map;
+  uint32_t pick;
+  int fd;
+
+  if (dir_mtime(ENTRIES_DIR, &mtime) != 0) {
+    perror("stat");
+    return NULL;
+  }
+
+  fd = open(INDEX_FILE, O_RDONLY);
+  if (fd >= 0) {
+    map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(struct index_header)) {
+      map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (map != MAP_FAILED) {
+      base = map;
+      hdr = map;
+      offs = (const uint32_t*)(base + sizeof(*hdr));
+      if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+          hdr->version == INDEX_VERSION && hdr->count > 0 &&
+          hdr->size == (uint64_t)st.st_size &&
+          hdr->mtime_sec == (int64_t)mtime.tv_sec &&
+          hdr->mtime_nsec == (int64_t)mtime.tv_nsec &&
+          (hdr->size - sizeof(*hdr)) / sizeof(*offs) >= hdr->count) {
+        pick = (uint32_t)rand() % hdr->count;
+        if (offs[pick] < hdr->size &&
+            memchr(base + offs[pick], '\0', hdr->size - offs[pick])) {
+          selected_file = arena_strdup(a, base + offs[pick]);
+        }
+      }
+      (void)munmap(map, (size_t)st.st_size);
+      if (selected_file) {
+        return selected_file;
+      }
+    }
+  }
+
+  /* Index missing or stale: scan the directory and refresh the index. */
+  if (debug == 1) {
+    fprintf(stderr, "[debug] rebuilding %s\n", INDEX_FILE);
+  }
+  names = list_texts(ENTRIES_DIR, &count);
+  if (!names) {
+    return NULL;
+  }
+  (void)write_name_index(INDEX_FILE, names, count, &mtime);
+
+  selected_file = arena_strdup(a, names[(size_t)rand() % count]);
+  free_names(names, count);
+  return selected_file;
+}
+
+char**
+list_texts(const char* dir, size_t* count)
+{
+  struct dirent* dent;
+  DIR* d;
+  char** names = NULL;
+  size_t cap = 0;
+
+  *count = 0;
+
+  if ((d = opendir(dir)) == NULL) {
+    perror("opendir");
+    return NULL;
+  }
+
+  while ((dent = readdir(d)) != NULL) {
+    if ((unsigned char)dent->d_type != (unsigned char)REGULAR_FILE)
+      continue;
+    if (*count == cap) {
+      char** grown;
+      cap = cap ? cap * 2 : 256;
+      grown = realloc(names, cap * sizeof(*names));
+      if (!grown) {
+        perror("realloc");
+        closedir(d);
+        free_names(names, *count);
+        *count = 0;
+        return NULL;
+      }
+      names = grown;
+    }
+    names[*count] = strdup(dent->d_name);
+    if (!names[*count]) {
+      perror("strdup");
+      closedir(d);
+      free_names(names, *count);
+      *count = 0;
+      return NULL;
+    }
+    (*count)++;
+  }
+  closedir(d);
+
+  if (*count == 0) {
+    free(names);
+    return NULL;
+  }
+
+  qsort(names, *count, sizeof(*names), cmp_names);
+  return names;
+}
+
+void
+free_names(char** names, size_t count)
+{
+  size_t n;
+
+  if (names == NULL) {
+    return;
+  }
+  for (n = 0; n < count; n++) {
+    free(names[n]);
+  }
+  free(names);
+}
+
+int
+dir_mtime(const char* dir, struct timespec* ts)
+{
+  struct stat st;
+
+  if (stat(dir, &st) != 0) {
+    return -1;
+  }
+  *ts = st.st_mtim;
+  return 0;
+}
+
+int
+write_name_index(const char* path,
+                 char** names,
+                 size_t count,
+                 const struct timespec* mtime)
+{
+  struct index_header hdr;
+  char tmp_path[PATH_MAX];
+  uint32_t* offs;
+  uint64_t off;
+  size_t n, len;
+  FILE* fp;
+
+  offs = malloc(count * sizeof(*offs));
+  if (!offs) {
+    perror("malloc");
+    return -1;
+  }
+
+  off = sizeof(hdr) + count * sizeof(*offs);
+  for (n = 0; n < count; n++) {
+    if (off > UINT32_MAX) {
+      free(offs);
+      return -1;
+    }
+    offs[n] = (uint32_t)off;
+    off += strlen(names[n]) + 1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  hdr.version = INDEX_VERSION;
+  hdr.count = (uint32_t)count;
+  hdr.mtime_sec = (int64_t)mtime->tv_sec;
+  hdr.mtime_nsec = (int64_t)mtime->tv_nsec;
+  hdr.size = off;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+  fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    /* Expected for unprivileged users of a system-wide install. */
+    if (debug == 1) {
+      fprintf(stderr, "[debug] cannot write %s: %s\n", path, strerror(errno));
+    }
+    free(offs);
+    return -1;
+  }
+
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      fwrite(offs, sizeof(*offs), count, fp) != count) {
+    goto fail;
+  }
+  for (n = 0; n < count; n++) {
+    len = strlen(names[n]) + 1;
+    if (fwrite(names[n], 1, len, fp) != len) {
+      goto fail;
+    }
+  }
+  free(offs);
+
+  if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+    perror("write index");
+    remove(tmp_path);
+    return -1;
+  }
+  return 0;
+
+fail:
+  perror("fwrite index");
+  free(offs);
+  fclose(fp);
+  remove(tmp_path);
+  return -1;
+}
+
+void
+seed_rng(void)
+{
+  srand((unsigned int)time(NULL));
+}
+
+void
+save_score(double wpm,
+           double cpm,
+           double accuracy,
+           double consistency,
+           char* path,
+           uint64_t text_id,
+           const struct latency_stats* lat)
+{
+  FILE* fp = scores_fp;
+  struct score_record r;
+  const char* name;
+  char id[17];
+  int k;
+
+  if (fp == NULL) {
+    return;
+  }
+
+  /* Save score in CSV format: WPM,CPM,Accuracy,Consistency,Text id,
+   * followed by P50,P95,P99 in ms and the slowest bigrams. Bigrams are
+   * written as the hex codes of their two chars so that the column never
+   * holds a delimiter, e.g. "7468:212.0|6865:180.5" */
+  snprintf(id, sizeof(id), "%016llx", (unsigned long long)text_id);
+  fprintf(fp,
+          "%.2f,%.2f,%.2f,%.2f,%s,%.1f,%.1f,%.1f,",
+          wpm,
+          cpm,
+          accuracy,
+          consistency,
+          text_id ? id : path,
+          lat->p50_ms,
+          lat->p95_ms,
+          lat->p99_ms);
+  for (k = 0; k < lat->nslow; k++) {
+    fprintf(fp,
+            "%s%02x%02x:%.1f",
+            k ? "|" : "",
+            (unsigned char)lat->slow[k].pair[0],
+            (unsigned char)lat->slow[k].pair[1],
+            lat->slow[k].mean_ms);
+  }
+  fputc('\n', fp);
+
+  memset(&r, 0, sizeof(r));
+  r.tag = SCORE_RECORD_TAG;
+  r.time = (int64_t)time(NULL);
+  r.text_id = text_id ? text_id : hash_str(path);
+  r.wpm = (float)wpm;
+  r.cpm = (float)cpm;
+  r.accuracy = (float)accuracy;
+  r.consistency = (float)consistency;
+  r.p50_ms = (float)lat->p50_ms;
+  r.p95_ms = (float)lat->p95_ms;
+  r.p99_ms = (float)lat->p99_ms;
+  name = strrchr(path, '/');
+  score_store_add(&r, name ? name + 1 : path);
+}
+
+uint64_t
+hash_str(const char* s)
+{
+  /* FNV-1a */
+  uint64_t h = 14695981039346656037u;
+
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211u;
+  }
+  return h;
+}
+
+/* XXH64 primes */
+#define XXH_P1 11400714785074694791ull
+#define XXH_P2 14029467366897019727ull
+#define XXH_P3 1609587929392839161ull
+#define XXH_P4 9650029242287828579ull
+#define XXH_P5 2870177450012600261ull
+
+/* xxh_rotl - Rotate @v left by @r bits. */
+static uint64_t
+xxh_rotl(uint64_t v, int r)
+{
+  return (v << r) | (v >> (64 - r));
+}
+
+/* xxh_read - Read @n bytes at @p as a little-endian integer. */
+static uint64_t
+xxh_read(const unsigned char* p, int n)
+{
+  uint64_t v = 0;
+
+  while (n-- > 0) {
+    v = (v << 8) | p[n];
+  }
+  return v;
+}
+
+/* xxh_round - Mix one 8-byte lane into an accumulator. */
+static uint64_t
+xxh_round(uint64_t acc, uint64_t in)
+{
+  return xxh_rotl(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+uint64_t
+hash_text(const char* s, size_t n)
+{
+  const unsigned char *p = (const unsigned char*)s, *end = p + n;
+  uint64_t h, v[4];
+  int k;
+
+  if (n >= 32) {
+    v[0] = XXH_P1 + XXH_P2;
+    v[1] = XXH_P2;
+    v[2] = 0;
+    v[3] = 0 - XXH_P1;
+    for (; end - p >= 32; p += 32) {
+      for (k = 0; k < 4; k++) {
+        v[k] = xxh_round(v[k], xxh_read(p + 8 * k, 8));
+      }
+    }
+    h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12) +
+        xxh_rotl(v[3], 18);
+    for (k = 0; k < 4; k++) {
+      h = (h ^ xxh_round(0, v[k])) * XXH_P1 + XXH_P4;
+    }
+  } else {
+    h = XXH_P5;
+  }
+  h += (uint64_t)n;
+
+  for (; end - p >= 8; p += 8) {
+    h = xxh_rotl(h ^ xxh_round(0, xxh_read(p, 8)), 27) * XXH_P1 + XXH_P4;
+  }
+  if (end - p >= 4) {
+    h = xxh_rotl(h ^ (xxh_read(p, 4) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h = xxh_rotl(h ^ (*p * XXH_P5), 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+size_t
+text_normalise(char* s)
+{
+  size_t r = 0, w = 0;
+  int space = 0;
+
+  for (; s[r]; r++) {
+    if ((unsigned char)s[r] < 0x80 && isspace((unsigned char)s[r])) {
+      space = w > 0;
+      continue;
+    }
+    if (space) {
+      s[w++] = ' ';
+      space = 0;
+    }
+    s[w++] = s[r];
+  }
+  s[w] = '\0';
+  return w;
+}
+
+/* score_footer_add - Fold one record into the running aggregates. */
+static int
+score_footer_add(struct score_footer* f,
+                 struct score_best** bests,
+                 const struct score_record* r,
+                 const char* name)
+{
+  struct score_best* grown;
+  uint32_t b;
+
+  if (f->count == 0 || r->wpm < f->min_wpm) {
+    f->min_wpm = r->wpm;
+  }
+  if (f->count == 0 || r->wpm > f->max_wpm) {
+    f->max_wpm = r->wpm;
+  }
+  f->count++;
+  f->sum_wpm += r->wpm;
+  f->sum_accuracy += r->accuracy;
+
+  f->recent_wpm[f->recent_pos] = r->wpm;
+  f->recent_pos = (f->recent_pos + 1) % SCORE_RECENT;
+  if (f->recent_len < SCORE_RECENT) {
+    f->recent_len++;
+  }
+
+  /* The best table has one entry per text ever typed, not per record. */
+  for (b = 0; b < f->nbest; b++) {
+    if ((*bests)[b].text_id == r->text_id) {
+      break;
+    }
+  }
+  if (b == f->nbest) {
+    grown = realloc(*bests, (f->nbest + 1) * sizeof(**bests));
+    if (!grown) {
+      return -1;
+    }
+    *bests = grown;
+    memset(&grown[b], 0, sizeof(grown[b]));
+    grown[b].text_id = r->text_id;
+    f->nbest++;
+  } else if ((*bests)[b].wpm >= r->wpm) {
+    return 0;
+  }
+  /* Records do not carry the name; refresh it in case the table was rebuilt
+   * with placeholder names. */
+  snprintf((*bests)[b].name, sizeof((*bests)[b].name), "%s", name);
+  (*bests)[b].wpm = r->wpm;
+  (*bests)[b].accuracy = r->accuracy;
+  (*bests)[b].time = r->time;
+  return 0;
+}
+
+/* file_lock - Take (F_WRLCK, F_RDLCK) or drop (F_UNLCK) the lock on a whole
+ * file, waiting for other processes as needed. */
+static int
+file_lock(int fd, short type)
+{
+  struct flock lk;
+
+  memset(&lk, 0, sizeof(lk));
+  lk.l_type = type;
+  lk.l_whence = SEEK_SET;
+  return fcntl(fd, F_SETLKW, &lk);
+}
+
+/* score_store_load - Read the aggregates of a score store opened as fd.
+ *
+ * Sets *end to the offset just past the last record. If the footer is
+ * invalid (a writer was interrupted mid-append), the aggregates are rebuilt
+ * from the records, which is the only case that costs O(history). */
+static int
+score_store_load(int fd,
+                 struct score_footer* f,
+                 struct score_best** bests,
+                 off_t* end)
+{
+  struct score_file_header hdr;
+  struct score_trailer tr;
+  struct score_record r;
+  struct stat st;
+  char name[24];
+  off_t off, tail;
+
+  memset(f, 0, sizeof(*f));
+  *bests = NULL;
+  *end = sizeof(hdr);
+
+  if (fstat(fd, &st) != 0) {
+    return -1;
+  }
+  if (st.st_size == 0) {
+    return 0;
+  }
+  if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+      memcmp(hdr.magic, SCORE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != SCORE_VERSION || hdr.record_size != sizeof(r)) {
+    fprintf(stderr, "Error: unrecognised score store\n");
+    return -1;
+  }
+
+  tail = st.st_size - (off_t)sizeof(tr);
+  if (tail >= (off_t)sizeof(hdr) &&
+      pread(fd, &tr, sizeof(tr), tail) == (ssize_t)sizeof(tr) &&
+      memcmp(tr.magic, SCORE_FOOTER_MAGIC, sizeof(tr.magic)) == 0 &&
+      tr.footer_off >= sizeof(hdr) && (off_t)tr.footer_off <= tail &&
+      pread(fd, f, sizeof(*f), (off_t)tr.footer_off) == (ssize_t)sizeof(*f) &&
+      (off_t)(tr.footer_off + sizeof(*f) + f->nbest * sizeof(**bests)) ==
+        tail) {
+    if (f->nbest > 0) {
+      *bests = malloc(f->nbest * sizeof(**bests));
+      if (!*bests ||
+          pread(fd,
+                *bests,
+                f->nbest * sizeof(**bests),
+                (off_t)(tr.footer_off + sizeof(*f))) !=
+            (ssize_t)(f->nbest * sizeof(**bests))) {
+        free(*bests);
+        *bests = NULL;
+        return -1;
+      }
+    }
+    *end = (off_t)tr.footer_off;
+    return 0;
+  }
+
+  if (debug == 1) {
+    fprintf(stderr, "[debug] score store footer missing, rebuilding\n");
+  }
+  memset(f, 0, sizeof(*f));
+  for (off = sizeof(hdr);
+       pread(fd, &r, sizeof(r), off) == (ssize_t)sizeof(r) &&
+       r.tag == SCORE_RECORD_TAG;
+       off += (off_t)sizeof(r)) {
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)r.text_id);
+    if (score_footer_add(f, bests, &r, name) != 0) {
+      return -1;
+    }
+  }
+  *end = off;
+  return 0;
+}
+
+int
+score_store_open(void)
+{
+  struct score_file_header hdr;
+  struct stat st;
+  int fd;
+
+  if (home_dir == NULL) {
+    return -1;
+  }
+  snprintf(
+    score_store.path, sizeof(score_store.path), "%s/%s", home_dir, store_file);
+
+  fd = open(score_store.path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("open score store");
+    return -1;
+  }
+  if (file_lock(fd, F_WRLCK) != 0 || fstat(fd, &st) != 0) {
+    perror("lock score store");
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SCORE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SCORE_VERSION;
+    hdr.record_size = sizeof(struct score_record);
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+      perror("write score store");
+      close(fd);
+      return -1;
+    }
+  }
+  (void)file_lock(fd, F_UNLCK);
+
+  score_store.fd = fd;
+  (void)atexit(score_store_close);
+  return 0;
+}
+
+void
+score_store_add(const struct score_record* r, const char* name)
+{
+  struct score_best* bests = NULL;
+  struct score_footer f;
+  struct score_trailer tr;
+  size_t bests_size;
+  off_t end;
+  int fd = score_store.fd;
+
+  if (fd < 0) {
+    return;
+  }
+  if (file_lock(fd, F_WRLCK) != 0) {
+    perror("lock score store");
+    return;
+  }
+  if (score_store_load(fd, &f, &bests, &end) != 0 ||
+      score_footer_add(&f, &bests, r, name) != 0) {
+    fprintf(stderr, "Error: score not saved to %s\n", score_store.path);
+    goto out;
+  }
+
+  /* The record goes where the old footer was. Bests only ever grow, so
+   * the new footer ends at or past the old end of the file. */
+  bests_size = f.nbest * sizeof(*bests);
+  memset(&tr, 0, sizeof(tr));
+  tr.footer_off = (uint64_t)end + sizeof(*r);
+  memcpy(tr.magic, SCORE_FOOTER_MAGIC, sizeof(tr.magic));
+  if (pwrite(fd, r, sizeof(*r), end) != (ssize_t)sizeof(*r) ||
+      pwrite(fd, &f, sizeof(f), (off_t)tr.footer_off) != (ssize_t)sizeof(f) ||
+      (bests_size > 0 &&
+       pwrite(fd, bests, bests_size, (off_t)(tr.footer_off + sizeof(f))) !=
+         (ssize_t)bests_size) ||
+      pwrite(fd,
+             &tr,
+             sizeof(tr),
+             (off_t)(tr.footer_off + sizeof(f) + bests_size)) !=
+        (ssize_t)sizeof(tr)) {
+    perror("write score store");
+  }
+
+out:
+  (void)file_lock(fd, F_UNLCK);
+  free(bests);
+}
+
+void
+score_store_close(void)
+{
+  int fd = score_store.fd;
+
+  if (fd < 0) {
+    return;
+  }
+  score_store.fd = -1;
+  if (fsync(fd) != 0) {
+    perror("Error saving score store");
+  }
+  close(fd);
+}
+
+int
+profile_open(void)
+{
+  char path[PATH_MAX];
+  struct profile_file* p;
+  struct stat st;
+  int fd;
+
+  if (home_dir == NULL) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/%s", home_dir, profile_name);
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("open profile");
+    return -1;
+  }
+
+  /* Size the file under the lock, so that a second process starting at the
+   * same time does not clear what the first one set up. */
+  if (file_lock(fd, F_WRLCK) != 0 || fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size != sizeof(*p) &&
+       (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(*p)) != 0))) {
+    perror("profile");
+    close(fd);
+    return -1;
+  }
+  p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap profile");
+    close(fd);
+    return -1;
+  }
+  if (memcmp(p->magic, PROFILE_MAGIC, sizeof(p->magic)) != 0 ||
+      p->version != PROFILE_VERSION || p->chars != BIGRAM_CHARS) {
+    if (debug == 1 && st.st_size > 0) {
+      fprintf(stderr, "[debug] starting a new profile in %s\n", path);
+    }
+    memset(p, 0, sizeof(*p));
+    memcpy(p->magic, PROFILE_MAGIC, sizeof(p->magic));
+    p->version = PROFILE_VERSION;
+    p->chars = BIGRAM_CHARS;
+  }
+  (void)file_lock(fd, F_UNLCK);
+
+  key_profile = p;
+  profile_fd = fd;
+  return 0;
+}
+
+void
+profile_merge(const struct key_stats* s)
+{
+  struct profile_file* p = key_profile;
+  size_t k;
+
+  if (p == NULL) {
+    return;
+  }
+  if (file_lock(profile_fd, F_WRLCK) != 0) {
+    perror("lock profile");
+    return;
+  }
+  for (k = 0; k < BIGRAM_CHARS; k++) {
+    p->key_n[k] += s->key_n[k];
+    p->key_err[k] += s->key_err[k];
+    p->key_us[k] += s->key_us[k];
+  }
+  /* Most bigrams are not in a session; leave their pages clean. */
+  for (k = 0; k < BIGRAM_CHARS * BIGRAM_CHARS; k++) {
+    if (s->bigram_n[k] > 0) {
+      p->bigram_n[k] += s->bigram_n[k];
+      p->bigram_err[k] += s->bigram_err[k];
+      p->bigram_us[k] += s->bigram_us[k];
+    }
+  }
+  p->sessions++;
+  (void)file_lock(profile_fd, F_UNLCK);
+}
+
+/* qsort comparator for print_stats: fastest first */
+static int
+cmp_bests(const void* a, const void* b)
+{
+  float wa = ((const struct score_best*)a)->wpm;
+  float wb = ((const struct score_best*)b)->wpm;
+
+  return (wa < wb) - (wa > wb);
+}
+
+int
+print_stats(void)
+{
+  struct score_footer f;
+  struct score_best* bests;
+  char path[PATH_MAX];
+  double recent = 0.0, avg;
+  off_t end;
+  uint32_t k;
+  int fd;
+
+  home_dir = getenv("HOME");
+  if (home_dir == NULL) {
+    fprintf(stderr, "Error: HOME environment variable is not set.\n");
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/%s", home_dir, store_file);
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 && errno == ENOENT) {
+    /* Scores saved before the binary store existed are only in the CSV. */
+    snprintf(path, sizeof(path), "%s/%s", home_dir, scores_file);
+    return print_csv_stats(path);
+  }
+  if (fd < 0) {
+    perror("open score store");
+    return -1;
+  }
+  /* Shared with score_store_add, which holds the lock only to append. */
+  if (file_lock(fd, F_RDLCK) != 0 ||
+      score_store_load(fd, &f, &bests, &end) != 0) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if (f.count == 0) {
+    printf("No scores recorded yet.\n");
+    free(bests);
+    return 0;
+  }
+
+  avg = f.sum_wpm / (double)f.count;
+  for (k = 0; k < f.recent_len; k++) {
+    recent += f.recent_wpm[k];
+  }
+  recent /= f.recent_len;
+
+  printf("Tests: %llu\n", (unsigned long long)f.count);
+  printf("All-time WPM: %.2f (min %.2f, max %.2f)\n", avg, f.min_wpm, f.max_wpm);
+  printf("All-time accuracy: %.2f%%\n", f.sum_accuracy / (double)f.count);
+  printf("Last %u tests: %.2f WPM (%+.2f vs all-time)\n",
+         f.recent_len,
+         recent,
+         recent - avg);
+
+  qsort(bests, f.nbest, sizeof(*bests), cmp_bests);
+  printf("Personal bests:\n");
+  for (k = 0; k < f.nbest && k < SCORE_TOP_BESTS; k++) {
+    printf("  %8.2f WPM %6.2f%%  %s\n",
+           bests[k].wpm,
+           bests[k].accuracy,
+           bests[k].name);
+  }
+  free(bests);
+  return 0;
+}
+
+/* parse_decimal - Parse a plain decimal number spanning exactly [p, end).
+ *
+ * Only what save_score writes is accepted: an optional sign, digits and an
+ * optional fraction. Returns 0 on success, -1 on anything else. */
+static int
+parse_decimal(const char* p, const char* end, double* out)
+{
+  double v = 0.0, scale = 1.0;
+  int neg = 0, digits = 0;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p++ == '-';
+  }
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+    v = v * 10.0 + (*p - '0');
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+      scale *= 0.1;
+      v += (*p - '0') * scale;
+    }
+  }
+  if (p != end || digits == 0) {
+    return -1;
+  }
+  *out = neg ? -v : v;
+  return 0;
+}
+
+int
+print_csv_stats(const char* path)
+{
+  double win_wpm[SCORE_RECENT], win_acc[SCORE_RECENT];
+  double sum_wpm = 0.0, sum_acc = 0.0, min_wpm = 0.0, max_wpm = 0.0;
+  double win_sum_wpm = 0.0, win_sum_acc = 0.0, best_win = 0.0;
+  double wpm, acc, avg;
+  const char *p, *end, *line_end, *c1, *c2, *c3;
+  unsigned long long n = 0, skipped = 0;
+  unsigned win_len = 0, win_pos = 0;
+  struct stat st;
+  void* map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "No scores recorded yet (%s)\n", path);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    printf("No scores recorded yet.\n");
+    return 0;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  (void)posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  /* One pass over the mapping: memchr finds each delimiter and only the WPM
+   * and accuracy columns are converted. Lines that do not parse are counted
+   * and skipped. */
+  p = map;
+  end = p + st.st_size;
+  for (; p < end; p = line_end + 1) {
+    line_end = memchr(p, '\n', (size_t)(end - p));
+    if (line_end == NULL) {
+      line_end = end;
+    }
+    if (line_end == p) {
+      continue;
+    }
+    c1 = memchr(p, ',', (size_t)(line_end - p));
+    c2 = c1 ? memchr(c1 + 1, ',', (size_t)(line_end - c1 - 1)) : NULL;
+    c3 = c2 ? memchr(c2 + 1, ',', (size_t)(line_end - c2 - 1)) : NULL;
+    if (c3 == NULL || parse_decimal(p, c1, &wpm) != 0 ||
+        parse_decimal(c2 + 1, c3, &acc) != 0) {
+      skipped++;
+      continue;
+    }
+
+    if (n == 0 || wpm < min_wpm) {
+      min_wpm = wpm;
+    }
+    if (n == 0 || wpm > max_wpm) {
+      max_wpm = wpm;
+    }
+    n++;
+    sum_wpm += wpm;
+    sum_acc += acc;
+
+    /* Moving window over the last SCORE_RECENT tests. */
+    if (win_len == SCORE_RECENT) {
+      win_sum_wpm -= win_wpm[win_pos];
+      win_sum_acc -= win_acc[win_pos];
+    } else {
+      win_len++;
+    }
+    win_wpm[win_pos] = wpm;
+    win_acc[win_pos] = acc;
+    win_sum_wpm += wpm;
+    win_sum_acc += acc;
+    win_pos = (win_pos + 1) % SCORE_RECENT;
+    if (win_len == SCORE_RECENT && win_sum_wpm / win_len > best_win) {
+      best_win = win_sum_wpm / win_len;
+    }
+  }
+  (void)munmap(map, (size_t)st.st_size);
+
+  if (skipped > 0) {
+    fprintf(stderr, "Skipped %llu malformed lines in %s\n", skipped, path);
+  }
+  if (n == 0) {
+    printf("No scores recorded yet.\n");
+    return 0;
+  }
+
+  avg = sum_wpm / (double)n;
+  printf("Tests: %llu\n", n);
+  printf("All-time WPM: %.2f (min %.2f, max %.2f)\n", avg, min_wpm, max_wpm);
+  printf("All-time accuracy: %.2f%%\n", sum_acc / (double)n);
+  printf("Last %u tests: %.2f WPM, %.2f%% accuracy (%+.2f vs all-time)\n",
+         win_len,
+         win_sum_wpm / win_len,
+         win_sum_acc / win_len,
+         win_sum_wpm / win_len - avg);
+  if (win_len == SCORE_RECENT) {
+    printf("Best %d-test average: %.2f WPM\n", SCORE_RECENT, best_win);
+  }
+  return 0;
+}
+
+/* put_varint - Append @v to @p as LEB128; returns the bytes written. */
+static size_t
+put_varint(unsigned char* p, uint64_t v)
+{
+  size_t n = 0;
+
+  do {
+    p[n] = (unsigned char)(v & 0x7f);
+    v >>= 7;
+    p[n] |= v ? 0x80 : 0;
+    n++;
+  } while (v);
+  return n;
+}
+
+/* get_varint - Decode a LEB128 value from [*p, end); -1 if truncated. */
+static int
+get_varint(const unsigned char** p, const unsigned char* end, uint64_t* v)
+{
+  int shift = 0;
+
+  *v = 0;
+  while (*p < end && shift < 64) {
+    *v |= (uint64_t)(**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80)) {
+      return 0;
+    }
+    shift += 7;
+  }
+  return -1;
+}
+
+int
+record_open(const char* path)
+{
+  record_fp = fopen(path, "ab");
+  if (record_fp == NULL) {
+    perror("fopen record");
+    return -1;
+  }
+  return 0;
+}
+
+void
+record_session(const char* path, const char* text, const struct key_log* log)
+{
+  struct record_header hdr;
+  unsigned char buf[4096];
+  const struct key_event* e;
+  uint64_t prev;
+  size_t k, n, keys_size = 0;
+  int pass;
+
+  if (record_fp == NULL) {
+    return;
+  }
+  if (log->dropped > 0) {
+    fprintf(stderr, "Session too long to record, %zu keys lost\n", log->dropped);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+  hdr.version = RECORD_VERSION;
+  hdr.path_len = (uint32_t)strlen(path);
+  hdr.text_len = (uint32_t)strlen(text);
+  hdr.nkeys = (uint32_t)log->len;
+
+  /* The first pass sizes the key stream for the header, the second writes
+   * it out through buf. */
+  for (pass = 0; pass < 2; pass++) {
+    prev = log->len ? log->ev[0].t_ns : 0;
+    for (k = 0, n = 0; k < log->len; k++) {
+      e = &log->ev[k];
+      n += put_varint(buf + n,
+                      e->ch >= 0 && key_printable((uint32_t)e->ch)
+                        ? (uint64_t)e->ch
+                        : RECORD_BACKSPACE);
+      n += put_varint(buf + n, e->t_ns - prev);
+      prev = e->t_ns;
+      if (n > sizeof(buf) - 16 || k + 1 == log->len) {
+        if (pass == 1 && fwrite(buf, 1, n, record_fp) != n) {
+          perror("fwrite record");
+          return;
+        }
+        keys_size += pass == 0 ? n : 0;
+        n = 0;
+      }
+    }
+    if (pass == 0) {
+      hdr.keys_size = (uint32_t)keys_size;
+      if (fwrite(&hdr, sizeof(hdr), 1, record_fp) != 1 ||
+          fwrite(path, 1, hdr.path_len + 1, record_fp) != hdr.path_len + 1 ||
+          fwrite(text, 1, hdr.text_len + 1, record_fp) != hdr.text_len + 1) {
+        perror("fwrite record");
+        return;
+      }
+    }
+  }
+  (void)fflush(record_fp);
+}
+
+int
+replay_file(const char* path,
+            struct session_bufs* sb,
+            struct score_acc* acc,
+            int print)
+{
+  struct record_header hdr;
+  const unsigned char *base, *p, *end, *keys, *keys_end;
+  const char *rpath, *text;
+  struct session_result r;
+  struct text_metrics m;
+  struct stat st;
+  uint64_t t, delta, key;
+  uint32_t k;
+  void* map;
+  int fd, done, ret = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open record");
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    fprintf(stderr, "Error: empty record %s\n", path);
+    return -1;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  (void)posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  base = map;
+  end = base + st.st_size;
+  for (p = base; p < end; p = keys_end) {
+    /* Each session is a header, its path, its text and its keys. Sessions
+     * are packed back to back, so the header is copied out of the mapping
+     * rather than read where it may be misaligned. */
+    if ((size_t)(end - p) >= sizeof(hdr)) {
+      memcpy(&hdr, p, sizeof(hdr));
+    }
+    if ((size_t)(end - p) < sizeof(hdr) ||
+        memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version < 1 || hdr.version > RECORD_VERSION ||
+        (uint64_t)(end - p) < sizeof(hdr) + (uint64_t)hdr.path_len + 1 +
+                                hdr.text_len + 1 + hdr.keys_size) {
+      fprintf(stderr,
+              "Error: corrupt record %s at offset %ld\n",
+              path,
+              (long)(p - base));
+      ret = -1;
+      break;
+    }
+    rpath = (const char*)p + sizeof(hdr);
+    text = rpath + hdr.path_len + 1;
+    keys = (const unsigned char*)text + hdr.text_len + 1;
+    keys_end = keys + hdr.keys_size;
+    if (rpath[hdr.path_len] != '\0' || text[hdr.text_len] != '\0') {
+      fprintf(stderr, "Error: corrupt record %s\n", path);
+      ret = -1;
+      break;
+    }
+
+    text_metrics_init(&m, text);
+    if (session_begin(sb, text, m.chars) != 0) {
+      perror("session_begin");
+      ret = -1;
+      break;
+    }
+    t = 0;
+    done = 0;
+    for (k = 0; k < hdr.nkeys && keys < keys_end && !done; k++) {
+      if (hdr.version == 1) {
+        key = *keys++;
+      } else if (get_varint(&keys, keys_end, &key) != 0) {
+        break;
+      }
+      if (get_varint(&keys, keys_end, &delta) != 0) {
+        break;
+      }
+      t += delta;
+      done = session_key(
+        sb, t, key <= CODE_POINT_MAX ? (int)key : RECORD_BACKSPACE);
+    }
+    if (done && k < hdr.nkeys) {
+      /* A round ends with its text, so this record was not made by typc. */
+      if (debug == 1) {
+        fprintf(stderr,
+                "[debug] skipping corrupt session of %s: keys past its end\n",
+                rpath);
+      }
+      acc->skipped++;
+      continue;
+    }
+    if (k != hdr.nkeys || sb->cur < sb->total) {
+      if (debug == 1) {
+        fprintf(stderr, "[debug] skipping incomplete session of %s\n", rpath);
+      }
+      acc->skipped++;
+      continue;
+    }
+
+    session_score(sb, &m, &r);
+    if (print == 1) {
+      printf("%.2f,%.2f,%.2f,%.2f,%s\n",
+             r.wpm,
+             r.cpm,
+             r.accuracy,
+             r.consistency,
+             rpath);
+    }
+    score_acc_add(acc, &r, hdr.nkeys);
+  }
+
+  (void)munmap(map, (size_t)st.st_size);
+  return ret;
+}
+
+void
+score_acc_add(struct score_acc* a, const struct session_result* r, size_t keys)
+{
+  if (a->sessions == 0 || r->wpm < a->min_wpm) {
+    a->min_wpm = r->wpm;
+  }
+  if (a->sessions == 0 || r->wpm > a->max_wpm) {
+    a->max_wpm = r->wpm;
+  }
+  a->sessions++;
+  a->keys += keys;
+  a->sum_wpm += r->wpm;
+  a->sum_accuracy += r->accuracy;
+  a->sum_consistency += r->consistency;
+}
+
+void
+score_acc_merge(struct score_acc* a, const struct score_acc* b)
+{
+  if (b->sessions > 0 && (a->sessions == 0 || b->min_wpm < a->min_wpm)) {
+    a->min_wpm = b->min_wpm;
+  }
+  if (b->sessions > 0 && (a->sessions == 0 || b->max_wpm > a->max_wpm)) {
+    a->max_wpm = b->max_wpm;
+  }
+  a->sessions += b->sessions;
+  a->keys += b->keys;
+  a->skipped += b->skipped;
+  a->sum_wpm += b->sum_wpm;
+  a->sum_accuracy += b->sum_accuracy;
+  a->sum_consistency += b->sum_consistency;
+}
+
+/* worker - One thread of run_workers. */
+struct worker
+{
+  pthread_t thread;
+  void (*fn)(void* ctx, size_t w, size_t n);
+  void* ctx;
+  size_t w;
+  size_t n;
+};
+
+static void*
+worker_main(void* arg)
+{
+  struct worker* wk = arg;
+
+  wk->fn(wk->ctx, wk->w, wk->n);
+  return NULL;
+}
+
+size_t
+run_workers(size_t nitems, void (*fn)(void* ctx, size_t w, size_t n), void* ctx)
+{
+  struct worker wk[MAX_WORKERS];
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t n = ncpu > 0 ? (size_t)ncpu : 1;
+  size_t w, started;
+
+  n = n < MAX_WORKERS ? n : MAX_WORKERS;
+  n = n < nitems ? n : nitems;
+  if (n == 0) {
+    return 0;
+  }
+
+  for (w = 0; w < n; w++) {
+    wk[w].fn = fn;
+    wk[w].ctx = ctx;
+    wk[w].w = w;
+    wk[w].n = n;
+  }
+  for (started = 1; started < n; started++) {
+    if (pthread_create(&wk[started].thread, NULL, worker_main, &wk[started]) !=
+        0) {
+      break;
+    }
+  }
+
+  /* Shard 0, and any shard whose thread could not be started, runs here. */
+  for (w = started; w < n; w++) {
+    fn(ctx, w, n);
+  }
+  fn(ctx, 0, n);
+
+  for (w = 1; w < started; w++) {
+    (void)pthread_join(wk[w].thread, NULL);
+  }
+  return n;
+}
+
+/* batch_job - Shared state of batch_worker; each file and each accumulator
+ * slot is only written by the worker that owns it. */
+struct batch_job
+{
+  const char* dir;
+  char** names;
+  size_t count;
+  struct score_acc* files;
+  int* failed;
+  struct score_acc workers[MAX_WORKERS];
+};
+
+static void
+batch_worker(void* ctx, size_t w, size_t n)
+{
+  struct batch_job* job = ctx;
+  struct session_bufs* sb;
+  struct score_acc acc;
+  char path[PATH_MAX];
+  size_t i;
+
+  memset(&acc, 0, sizeof(acc));
+  sb = calloc(1, sizeof(*sb));
+  if (!sb) {
+    perror("calloc");
+    for (i = w; i < job->count; i += n) {
+      job->failed[i] = 1;
+    }
+    return;
+  }
+
+  for (i = w; i < job->count; i += n) {
+    snprintf(path, sizeof(path), "%s/%s", job->dir, job->names[i]);
+    if (replay_file(path, sb, &job->files[i], 0) != 0) {
+      job->failed[i] = 1;
+    }
+    score_acc_merge(&acc, &job->files[i]);
+  }
+
+  /* The accumulator lives on this thread's stack until the end, so that
+   * workers never write to neighbouring memory while they run. */
+  job->workers[w] = acc;
+  session_bufs_free(sb);
+  free(sb);
+}
+
+static void
+print_acc(const char* label, const struct score_acc* a)
+{
+  if (a->sessions == 0) {
+    printf("%s: no sessions\n", label);
+    return;
+  }
+  printf("%s: %zu sessions, %zu keys, %.2f WPM (min %.2f, max %.2f), "
+         "%.2f%% accuracy, %.2f%% consistency\n",
+         label,
+         a->sessions,
+         a->keys,
+         a->sum_wpm / (double)a->sessions,
+         a->min_wpm,
+         a->max_wpm,
+         a->sum_accuracy / (double)a->sessions,
+         a->sum_consistency / (double)a->sessions);
+}
+
+int
+batch_replay(const char* dir)
+{
+  struct batch_job job;
+  struct score_acc total;
+  uint64_t start, t;
+  size_t i, nworkers;
+  int failed = 0;
+
+  memset(&job, 0, sizeof(job));
+  job.dir = dir;
+  job.names = list_texts(dir, &job.count);
+  if (!job.names) {
+    fprintf(stderr, "Error: no session logs in %s\n", dir);
+    return -1;
+  }
+  job.files = calloc(job.count, sizeof(*job.files));
+  job.failed = calloc(job.count, sizeof(*job.failed));
+  if (!job.files || !job.failed) {
+    perror("calloc");
+    free(job.files);
+    free(job.failed);
+    free_names(job.names, job.count);
+    return -1;
+  }
+
+  start = now_ns();
+  nworkers = run_workers(job.count, batch_worker, &job);
+  t = now_ns() - start;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < nworkers; i++) {
+    score_acc_merge(&total, &job.workers[i]);
+  }
+  for (i = 0; i < job.count; i++) {
+    print_acc(job.names[i], &job.files[i]);
+    failed |= job.failed[i];
+  }
+  print_acc("total", &total);
+  if (total.skipped > 0) {
+    printf("skipped %zu incomplete sessions\n", total.skipped);
+  }
+  if (debug == 1) {
+    fprintf(stderr,
+            "[debug] %zu workers replayed %zu keys in %.3f s "
+            "(%.2fM keys/s)\n",
+            nworkers,
+            total.keys,
+            (double)t / 1e9,
+            t ? (double)total.keys * 1e3 / (double)t : 0.0);
+  }
+
+  free(job.files);
+  free(job.failed);
+  free_names(job.names, job.count);
+  return failed ? -1 : 0;
+}
+
+int
+serve_races(const char* path)
+{
+  struct race_texts texts;
+  int ret;
+
+  memset(&texts, 0, sizeof(texts));
+  seed_rng();
+  texts.have_corpus = corpus_open_current(&texts.corpus) == 0;
+  ret = race_serve(path, pick_race_text, &texts, debug == 1);
+  arena_free(&texts.arena);
+  if (texts.have_corpus) {
+    corpus_close(&texts.corpus);
+  }
+  return ret;
+}
+
+int
+pick_race_text(void* ctx, struct race_pick* pick)
+{
+  struct race_texts* texts = ctx;
+
+  arena_reset(&texts->arena);
+  if (choose_text(texts->have_corpus ? &texts->corpus : NULL,
+                  &texts->arena,
+                  &texts->choice) != 0) {
+    return -1;
+  }
+  memset(pick, 0, sizeof(*pick));
+  pick->path = texts->choice.path;
+  pick->text = texts->choice.text;
+  pick->len = texts->choice.metrics.bytes;
+  pick->chars = texts->choice.metrics.chars;
+  pick->entry = texts->choice.entry;
+  if (texts->have_corpus) {
+    pick->corpus_mtime_sec = texts->corpus.hdr->src_mtime_sec;
+    pick->corpus_mtime_nsec = texts->corpus.hdr->src_mtime_nsec;
+  }
+  return 0;
+}
+
+int
+race_countdown(struct session_bufs* sb)
+{
+  int row, ch;
+  uint64_t now, left;
+
+  for (;;) {
+    now = now_ns();
+    if (now >= race.start_ns) {
+      return 0;
+    }
+    left = race.start_ns - now;
+    render_frame(&sb->rs, &sb->glyphs, getmaxx(stdscr), sb->typed, 0);
+    row = getmaxy(stdscr) - STATUS_ROWS;
+    if (row >= 1) {
+      (void)attrset(A_NORMAL);
+      (void)move(row, 0);
+      (void)clrtoeol();
+      (void)mvprintw(row,
+                     0,
+                     "Race %u starts in %d",
+                     race.race,
+                     (int)((left + 999999999u) / 1000000000u));
+    }
+    (void)refresh();
+
+    timeout((int)((left < 100000000u ? left : 100000000u) / 1000000 + 1));
+    ch = read_key();
+    if (ch == KEY_FN(KEY_RESIZE)) {
+      (void)clear();
+      sb->rs.full = 1;
+    }
+    if (race_poll(&race) < 0) {
+      return -1;
+    }
+  }
+}
+
+/* race_wait_text - Wait for the next race; returns -1 to stop racing. */
+static int
+race_wait_text(void)
+{
+  int ch, got;
+
+  (void)clear();
+  while (!race.have_text) {
+    (void)mvprintw(0, 0, "Waiting for the next race on %s", join_path);
+    (void)move(1, 0);
+    (void)clrtoeol();
+    if (race.board_race != 0 && !race.board.over) {
+      (void)mvprintw(1,
+                     0,
+                     "Race %u running with %u racers",
+                     race.board_race,
+                     race.board.racers);
+    }
+    (void)mvprintw(3, 5, "[[ q to quit ]]");
+    (void)refresh();
+
+    timeout(100);
+    ch = getch();
+    if (ch == 'q') {
+      timeout(-1);
+      return -1;
+    }
+    got = race_poll(&race);
+    if (got < 0) {
+      timeout(-1);
+      return -1;
+    }
+  }
+  timeout(-1);
+  race.have_text = 0;
+  return 0;
+}
+
+/* race_wait_results - Show the leaderboard under the results until the user
+ * moves on; returns the key pressed, or 'q' if the server went away. */
+static int
+race_wait_results(uint32_t round_race)
+{
+  const struct race_entry* e;
+  int ch, k, row = 7;
+
+  for (;;) {
+    if (race.board_race == round_race) {
+      (void)move(row, 0);
+      (void)clrtobot();
+      (void)mvprintw(row,
+                     0,
+                     "Race %u, %u racers%s",
+                     round_race,
+                     race.board.racers,
+                     race.board.over ? ", final" : "");
+      for (k = 0; k < race.board.n; k++) {
+        e = &race.top[k];
+        (void)mvprintw(row + 1 + k,
+                       2,
+                       "%d. %-*.*s %3u%% %6.1f WPM%s",
+                       k + 1,
+                       RACE_NAME_LEN,
+                       RACE_NAME_LEN,
+                       e->name,
+                       e->total ? e->cur * 100u / e->total : 100u,
+                       e->wpm10 / 10.0,
+                       e->place ? "  done" : "");
+      }
+      if (race.board.rank > RACE_TOP) {
+        (void)mvprintw(row + 2 + k, 2, "You: #%u", race.board.rank);
+      }
+    }
+    (void)mvprintw(5,
+                   5,
+                   race.board_race == round_race && race.board.over
+                     ? "[[ Press any key for the next race, q to quit ]]"
+                     : "[[ Waiting for the others, q to quit ]]          ");
+    (void)refresh();
+
+    timeout(race.board_race == round_race && race.board.over ? -1 : 100);
+    ch = getch();
+    if (race.board_race == round_race && race.board.over && ch != ERR &&
+        ch != KEY_RESIZE) {
+      return ch;
+    }
+    if (ch == 'q') {
+      return ch;
+    }
+    if (race_poll(&race) < 0) {
+      return 'q';
+    }
+  }
+}
+
+int
+race_join(const char* path, struct session_bufs* sb)
+{
+  struct text_metrics m;
+  struct corpus corpus;
+  const struct corpus_entry* e;
+  uint32_t round_race;
+  uint64_t id;
+  int have_corpus, ret = 0;
+
+  if (race_connect(&race, path) != 0) {
+    return -1;
+  }
+  have_corpus = corpus_open_current(&corpus) == 0;
+  __init_ncurses();
+  for (;;) {
+    if (race_wait_text() != 0) {
+      break;
+    }
+    round_race = race.race;
+
+    /* Racers on the server's host normally have the same corpus, whose
+     * metrics and id of the text save analysing the copy received. */
+    e = have_corpus && race.info.entry < corpus.hdr->count &&
+            corpus.hdr->src_mtime_sec == race.info.corpus_mtime_sec &&
+            corpus.hdr->src_mtime_nsec == race.info.corpus_mtime_nsec
+          ? &corpus.entries[race.info.entry]
+          : NULL;
+    if (e != NULL && e->text_len == race.info.text_len) {
+      corpus_entry_metrics(e, &m);
+      id = e->id;
+    } else {
+      text_metrics_init(&m, race.text);
+      id = hash_text(race.text, m.bytes);
+    }
+    run_typing_trainer(sb, race.path, id, race.text, &m, NULL);
+    if (race.fd < 0 || race_wait_results(round_race) == 'q') {
+      break;
+    }
+  }
+  timeout(-1);
+  (void)endwin();
+  if (have_corpus) {
+    corpus_close(&corpus);
+  }
+
+  if (race_poll(&race) < 0) {
+    fprintf(stderr, "Lost the connection to the race server\n");
+    ret = -1;
+  }
+  close(race.fd);
+  race.fd = -1;
+  return ret;
+}
+
+int
+replay(const char* path)
+{
+  static struct session_bufs sb;
+  struct score_acc acc;
+  uint64_t start, t;
+  int ret;
+
+  memset(&acc, 0, sizeof(acc));
+  start = now_ns();
+  ret = replay_file(path, &sb, &acc, 1);
+  t = now_ns() - start;
+
+  if (acc.skipped > 0) {
+    fprintf(stderr, "Skipped %zu incomplete sessions\n", acc.skipped);
+  }
+  if (debug == 1) {
+    fprintf(stderr,
+            "[debug] replayed %zu sessions, %zu keys in %.3f s (%.2fM keys/s)\n",
+            acc.sessions,
+            acc.keys,
+            (double)t / 1e9,
+            t ? (double)acc.keys * 1e3 / (double)t : 0.0);
+  }
+  session_bufs_free(&sb);
+  return ret;
+}
+
+int
+scroll_offset(const struct glyph_table* g,
+              int current_index,
+              int screen_width,
+              int prev)
+{
+  /* Keep the cursor char_offset columns away from the right edge. */
+  long target =
+    (long)g->col[current_index] + char_offset + 1 - (long)screen_width;
+  int k = prev < current_index ? prev : current_index;
+
+  if (target <= 0) {
     return 0;
   }
-  /* Remove trailing slash, if any. */
-  if (tmp[len - 1] == '/') {
-    tmp[len - 1] = '\0';
+  k = k > 0 ? k : 0;
+  while (k < current_index && (long)g->col[k] < target) {
+    k++;
   }
-  /* Create each directory component in the path. */
-  for (p = tmp + 1; *p; p++) {
-    if (*p == '/') {
-      *p = '\0';
-      if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
-        perror("mkdir");
-        free(tmp);
+  while (k > 0 && (long)g->col[k - 1] >= target) {
+    k--;
+  }
+  return k;
+}
+
+/* Attribute classes of draw_span */
+enum
+{
+  SPAN_CORRECT,
+  SPAN_ERROR,
+  SPAN_UNTYPED
+};
+
+void
+mismatch_mask(const uint32_t* a, const uint32_t* b, size_t n, uint64_t* mask)
+{
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(__SSE2__)
+  static const uint32_t lanes[4] = { 1, 2, 4, 8 };
+#endif
+  size_t i, k, lim;
+  uint64_t bits;
+
+  for (i = 0; i < n; i += lim) {
+    lim = n - i < 64 ? n - i : 64;
+    bits = 0;
+    k = 0;
+#if defined(__SSE2__)
+    for (; k + 4 <= lim; k += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(const void*)(a + i + k));
+      __m128i y = _mm_loadu_si128((const __m128i*)(const void*)(b + i + k));
+      int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, y)));
+
+      bits |= (uint64_t)(eq ^ 0xf) << k;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; k + 4 <= lim; k += 4) {
+      uint32x4_t eq = vceqq_u32(vld1q_u32(a + i + k), vld1q_u32(b + i + k));
+
+      bits |= (uint64_t)vaddvq_u32(vbicq_u32(vld1q_u32(lanes), eq)) << k;
+    }
+#endif
+    for (; k < lim; k++) {
+      bits |= (uint64_t)(a[i + k] != b[i + k]) << k;
+    }
+    *mask++ = bits;
+  }
+}
+
+/* mask_ctz - Index of the lowest set bit of a non-zero mask. */
+static int
+mask_ctz(uint64_t mask)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(mask);
+#else
+  int i = 0;
+
+  for (; (mask & 1) == 0; mask >>= 1) {
+    i++;
+  }
+  return i;
+#endif
+}
+
+/* span_run_end - End of the run of correct (@err 0) or incorrect glyphs that
+ * starts at @from, before @end, the end of the typed part of a span. */
+static int
+span_run_end(const struct glyph_table* g,
+             const uint32_t* typed,
+             int from,
+             int end,
+             int err)
+{
+  uint64_t mask;
+  int n;
+
+  while (from < end) {
+    n = end - from < 64 ? end - from : 64;
+    mismatch_mask(typed + from, g->cp + from, (size_t)n, &mask);
+    /* The run goes on while the bits match the class of its first glyph. */
+    mask = err ? ~mask : mask;
+    mask &= n < 64 ? ((uint64_t)1 << n) - 1 : ~(uint64_t)0;
+    if (mask != 0) {
+      return from + mask_ctz(mask);
+    }
+    from += n;
+  }
+  return end;
+}
+
+/* draw_glyphs - Write glyphs [from, to) of @g at @row, @col; bytes of invalid
+ * UTF-8 are written as the characters they were read as. */
+static void
+draw_glyphs(int row, int col, const struct glyph_table* g, int from, int to)
+{
+  char buf[4];
+  int i;
+
+  (void)move(row, col);
+  if (g->raw == 0) {
+    (void)addnstr(g->text + g->off[from], (int)(g->off[to] - g->off[from]));
+    return;
+  }
+  while (from < to) {
+    for (i = from; i < to && (g->cp[i] < 0x80 || g->off[i + 1] > g->off[i] + 1);
+         i++)
+      ;
+    if (i > from) {
+      (void)addnstr(g->text + g->off[from], (int)(g->off[i] - g->off[from]));
+    }
+    if (i < to) {
+      (void)addnstr(buf, (int)utf8_encode(g->cp[i], buf));
+      i++;
+    }
+    from = i;
+  }
+}
+
+/* draw_cells - Write glyphs [from, to) of an ASCII text (see glyph_table) at
+ * @row, @col as ready-made cells with @attr, which skips the character
+ * conversion addnstr does for every byte. */
+static void
+draw_cells(int row,
+           int col,
+           const struct glyph_table* g,
+           int from,
+           int to,
+           attr_t attr)
+{
+  chtype cells[256];
+  int i, n;
+
+  while (from < to) {
+    n = to - from < 256 ? to - from : 256;
+    for (i = 0; i < n; i++) {
+      cells[i] = (chtype)(unsigned char)g->text[from + i] | attr;
+    }
+    (void)mvaddchnstr(row, col, cells, n);
+    from += n;
+    col += n;
+  }
+}
+
+void
+draw_span(int row,
+          int col,
+          const struct glyph_table* g,
+          const uint32_t* typed,
+          int from,
+          int to,
+          int current_index)
+{
+  static const attr_t attrs[] = { COLOR_PAIR(1),
+                                  COLOR_PAIR(3),
+                                  COLOR_PAIR(2) | A_DIM };
+  int typed_end = to < current_index ? to : current_index;
+  char buf[4];
+  int start, cls, i;
+
+  while (from < to) {
+    start = from;
+    /* Untyped text is always one run, so skip the comparisons for it. */
+    if (from >= typed_end) {
+      cls = SPAN_UNTYPED;
+      from = to;
+    } else {
+      cls = typed[from] == g->cp[from] ? SPAN_CORRECT : SPAN_ERROR;
+      from = span_run_end(g, typed, from, typed_end, cls == SPAN_ERROR);
+    }
+
+    if (g->ascii && (cls != SPAN_ERROR || HIDE_ERR)) {
+      draw_cells(row, col, g, start, from, attrs[cls]);
+      col += from - start;
+      continue;
+    }
+    (void)attrset(attrs[cls]);
+    if (cls == SPAN_ERROR && !HIDE_ERR) {
+      /* Each typed character goes where the expected one is. */
+      for (i = start; i < from; i++) {
+        (void)mvaddnstr(row,
+                        col + (int)(g->col[i] - g->col[start]),
+                        buf,
+                        (int)utf8_encode(typed[i], buf));
+      }
+    } else {
+      /* If HIDE_ERR is 1, show expected chars */
+      draw_glyphs(row, col, g, start, from);
+    }
+    col += (int)(g->col[from] - g->col[start]);
+  }
+  (void)attrset(A_NORMAL);
+}
+
+int
+wrap_layout_build(struct wrap_layout* l,
+                  const struct glyph_table* g,
+                  int width)
+{
+  int total_chars = (int)g->n;
+  int start = 0, lim, brk, e;
+  int* grown;
+
+  if (width < 1) {
+    width = 1;
+  }
+  l->width = width;
+  l->nlines = 0;
+
+  for (;;) {
+    /* One more entry for this line and one for the end sentinel. */
+    if (l->nlines + 2 > l->cap) {
+      int cap =
+        l->cap ? l->cap * 2 : (int)(g->col[total_chars] / (uint32_t)width) + 16;
+      grown = realloc(l->starts, (size_t)cap * sizeof(*l->starts));
+      if (!grown) {
         return -1;
       }
-      *p = '/';
+      l->starts = grown;
+      l->cap = cap;
+    }
+    l->starts[l->nlines] = start;
+    if (start >= total_chars) {
+      break;
+    }
+    l->nlines++;
+
+    /* The glyphs from start that fit in width columns, at least one. */
+    lim = start + 1;
+    while (lim < total_chars &&
+           g->col[lim + 1] - g->col[start] <= (uint32_t)width) {
+      lim++;
+    }
+    brk = 0;
+    for (e = start; e < lim; e++) {
+      if (g->cp[e] == '\n') {
+        brk = e + 1;
+        break;
+      }
+      if (g->cp[e] < 0x80 && isspace((int)g->cp[e])) {
+        brk = e + 1;
+      }
+    }
+    if (e == lim && (lim == total_chars || brk == 0)) {
+      /* The rest fits, or a single word is wider than the screen. */
+      brk = lim;
     }
+    start = brk;
   }
+  return 0;
+}
 
-  /* Create the final directory. */
-  if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
-    perror("mkdir");
-    free(tmp);
+int
+wrap_line_of(const struct wrap_layout* l, int i)
+{
+  int lo = 0, hi = l->nlines - 1, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (l->starts[mid] <= i) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+void
+render_scrolled(struct render_state* rs,
+                const struct glyph_table* g,
+                int screen_width,
+                const uint32_t* typed,
+                int current_index)
+{
+  int total_chars = (int)g->n;
+  int offset = scroll_offset(g, current_index, screen_width, rs->offset);
+  int lo, hi;
+
+  if (rs->full || screen_width != rs->width) {
+    (void)erase();
+    draw_scrolled(g, offset, screen_width, typed, current_index);
+  } else if (offset != rs->offset) {
+    /* The scroll window moved: every cell of the row shifted. */
+    (void)move(0, 0);
+    (void)clrtoeol();
+    draw_scrolled(g, offset, screen_width, typed, current_index);
+  } else if (current_index != rs->index) {
+    lo = current_index < rs->index ? current_index : rs->index;
+    hi = current_index < rs->index ? rs->index : current_index;
+    hi = hi + 1 < total_chars ? hi + 1 : total_chars;
+    while (hi > lo && (int)(g->col[hi] - g->col[offset]) > screen_width) {
+      hi--;
+    }
+    draw_span(0,
+              (int)(g->col[lo] - g->col[offset]),
+              g,
+              typed,
+              lo,
+              hi,
+              current_index);
+  }
+
+  rs->full = 0;
+  rs->width = screen_width;
+  rs->offset = offset;
+  rs->index = current_index;
+}
+
+void
+render_wrapped(struct render_state* rs,
+               const struct glyph_table* g,
+               int screen_width,
+               const uint32_t* typed,
+               int current_index)
+{
+  struct wrap_layout* l = &rs->layout;
+  int total_chars = (int)g->n;
+  int rows = getmaxy(stdscr) - STATUS_ROWS;
+  int offset, line, lo, hi, i, next;
+
+  rows = rows > 0 ? rows : 1;
+  if (l->width != screen_width) {
+    if (wrap_layout_build(l, g, screen_width) != 0) {
+      (void)endwin();
+      perror("wrap_layout_build");
+      exit(EXIT_FAILURE);
+    }
+    rs->full = 1;
+  }
+  /* Keep the cursor on the second row once the text no longer fits. */
+  line = wrap_line_of(l, current_index);
+  offset = line - 1 < l->nlines - rows ? line - 1 : l->nlines - rows;
+  offset = offset > 0 ? offset : 0;
+
+  if (rs->full || screen_width != rs->width || offset != rs->offset) {
+    (void)erase();
+    draw_wrapped(g, l, offset, rows, typed, current_index);
+  } else if (current_index != rs->index) {
+    lo = current_index < rs->index ? current_index : rs->index;
+    hi = current_index < rs->index ? rs->index : current_index;
+    hi = hi + 1 < total_chars ? hi + 1 : total_chars;
+    /* Split the damaged range at line boundaries. */
+    for (i = lo; i < hi; i = next) {
+      line = wrap_line_of(l, i);
+      next = l->starts[line + 1] < hi ? l->starts[line + 1] : hi;
+      if (line >= offset && line < offset + rows) {
+        draw_span(line - offset,
+                  (int)(g->col[i] - g->col[l->starts[line]]),
+                  g,
+                  typed,
+                  i,
+                  next,
+                  current_index);
+      }
+    }
+  }
+
+  rs->full = 0;
+  rs->width = screen_width;
+  rs->offset = offset;
+  rs->index = current_index;
+}
+
+void
+draw_scrolled(const struct glyph_table* g,
+              int offset,
+              int screen_width,
+              const uint32_t* typed,
+              int current_index)
+{
+  /* Original horizontal scrolling mode: every glyph that fits the row */
+  int end = offset;
+
+  while (end < (int)g->n &&
+         (int)(g->col[end + 1] - g->col[offset]) <= screen_width) {
+    end++;
+  }
+  draw_span(0, 0, g, typed, offset, end, current_index);
+}
+
+void
+draw_wrapped(const struct glyph_table* g,
+             const struct wrap_layout* layout,
+             int top,
+             int rows,
+             const uint32_t* typed,
+             int current_index)
+{
+  int line;
+
+  /* In wrap mode, draw one span per visible line */
+  for (line = top; line < layout->nlines && line < top + rows; line++) {
+    draw_span(line - top,
+              0,
+              g,
+              typed,
+              layout->starts[line],
+              layout->starts[line + 1],
+              current_index);
+  }
+}
+
+void
+run_typing_trainer(struct session_bufs* sb,
+                   char* path,
+                   uint64_t text_id,
+                   const char* text,
+                   const struct text_metrics* m,
+                   struct text_stream* st)
+{
+  int ch, dirty = 1, racing = race.fd >= 0 && st == NULL, got;
+  uint64_t t, now, last_frame = 0, wait, limit, left;
+  struct render_state* rs = &sb->rs;
+  struct session_result r;
+  struct text_metrics typed_m;
+  size_t word;
+  int screen_width;
+
+  if (session_begin(sb, text, st ? STREAM_CAP : m->chars) != 0) {
+    perror("session_begin");
+    return;
+  }
+  limit = st != NULL && word_limit == 0 ? (uint64_t)time_limit * 1000000000u
+                                        : 0;
+
+  /* Start from a full repaint; keep the line-break table's storage only. */
+  rs->full = 1;
+  rs->width = 0;
+  rs->offset = 0;
+  rs->index = 0;
+  rs->layout.width = 0;
+  if (racing && race_countdown(sb) != 0) {
+    racing = 0;
+  }
+
+  /* Typing loop. Keys are read and timestamped as soon as they arrive, while
+   * frames are coalesced to at most one per FRAME_NS, so a burst of keys
+   * never waits behind rendering. */
+  while (sb->cur < sb->total) {
+    now = now_ns();
+    left = 0;
+    if (limit > 0 && sb->log.len > 0) {
+      if (now - sb->log.first_ns >= limit) {
+        break;
+      }
+      left = limit - (now - sb->log.first_ns);
+    }
+    if (racing) {
+      /* The round ends with the race, finished or not. */
+      got = race_poll(&race);
+      if (got < 0 || (race.board_race == race.race && race.board.over)) {
+        break;
+      }
+      dirty |= got & RACE_GOT_BOARD;
+    }
+    if (dirty && now - last_frame >= FRAME_NS) {
+      screen_width = getmaxx(stdscr);
+      t = trace_begin();
+      render_frame(rs, &sb->glyphs, screen_width, sb->typed, (int)sb->cur);
+      draw_status(sb, m, now);
+      trace_end("draw", t);
+      t = trace_begin();
+      (void)refresh();
+      trace_end("refresh", t);
+      last_frame = now;
+      dirty = 0;
+    }
+
+    /* Sleep until a key arrives or the pending frame or the next ticker
+     * update is due; before the first key there is nothing to update. */
+    if (dirty || sb->log.len > 0 || racing) {
+      wait = dirty ? FRAME_NS - (now - last_frame) : TICKER_NS;
+      wait = left > 0 && left < wait ? left : wait;
+      wait = racing && wait > RACE_POLL_NS ? RACE_POLL_NS : wait;
+      timeout((int)((wait + 999999) / 1000000));
+    } else {
+      timeout(-1);
+    }
+    t = trace_begin();
+    ch = read_key();
+    trace_end("getch", t);
+    if (ch == ERR) {
+      dirty = 1;
+      continue;
+    }
+    t = now_ns();
+    dirty = 1;
+    if (ch == KEY_FN(KEY_RESIZE)) {
+      /* Force the terminal itself to be repainted too. */
+      (void)clear();
+      rs->full = 1;
+      continue;
+    }
+    (void)session_key(sb, t, ch);
+    if (st != NULL && stream_advance(st, sb)) {
+      rs->full = 1;
+      rs->layout.width = 0;
+    }
+    if (racing) {
+      race_report(&race,
+                  (uint32_t)sb->cur,
+                  (uint32_t)sb->errors,
+                  live_wpm(sb, m, t),
+                  sb->cur == sb->total);
+    }
+  }
+  timeout(-1);
+  profile_merge(&sb->keys);
+
+  if (st != NULL) {
+    /* Score what was typed: the text dropped from the window and the part
+     * of the window before the cursor. */
+    typed_m = st->done;
+    word = st->done_word;
+    text_metrics_add(&typed_m, st->buf, sb->glyphs.off[sb->cur], &word);
+    session_score(sb, &typed_m, &r);
+  } else if (sb->cur < sb->total) {
+    /* A race that ended before the text did. */
+    memset(&typed_m, 0, sizeof(typed_m));
+    text_metrics_add(&typed_m, text, sb->glyphs.off[sb->cur], NULL);
+    session_score(sb, &typed_m, &r);
+    draw_results(r.wpm, r.cpm, r.accuracy, r.consistency, &sb->lat);
+    return;
+  } else {
+    session_score(sb, m, &r);
+  }
+  /* Key indices of a stream refer to a window that has since moved, so
+   * streams are neither folded into the profile nor recorded. */
+  if (adaptive_mode == 1 && st == NULL) {
+    weakness_update(&weak_profile, &sb->glyphs, &sb->log, &sb->lat);
+  }
+
+  draw_results(r.wpm, r.cpm, r.accuracy, r.consistency, &sb->lat);
+  t = trace_begin();
+  save_score(
+    r.wpm, r.cpm, r.accuracy, r.consistency, path, text_id, &sb->lat);
+  trace_end("save score", t);
+  if (st == NULL) {
+    record_session(path, text, &sb->log);
+  }
+}
+
+void
+draw_status(const struct session_bufs* sb,
+            const struct text_metrics* m,
+            uint64_t now)
+{
+  int row = getmaxy(stdscr) - STATUS_ROWS;
+  double secs = 0.0, wpm, now_wpm = 0.0, acc = 100.0, per_char, dt;
+  int oldest;
+
+  if (row < 1) {
+    return;
+  }
+  per_char = m->chars ? (double)m->non_space / (double)m->chars /
+                          m->avg_word_len * 60.0
+                      : 0.0;
+  if (sb->log.len > 0) {
+    secs = (double)(now - sb->log.first_ns) / 1e9;
+  }
+  wpm = live_wpm(sb, m, now);
+  if (sb->roll_len > 1) {
+    oldest = sb->roll_len < ROLL_KEYS ? 0 : sb->roll_pos;
+    dt = (double)(now - sb->roll[oldest].t_ns) / 1e9;
+    if (dt > 0.0 && sb->cur > sb->roll[oldest].cur) {
+      now_wpm = (double)(sb->cur - sb->roll[oldest].cur) * per_char / dt;
+    }
+  }
+  if (sb->base + sb->cur > 0) {
+    acc = (double)sb->correct * 100.0 / (double)(sb->base + sb->cur);
+  }
+  (void)attrset(A_NORMAL);
+  (void)move(row, 0);
+  (void)clrtoeol();
+  (void)mvprintw(row,
+                 0,
+                 "%6.1f WPM (%6.1f now)  %5.1f%%  %zu err  %d:%02d",
+                 wpm,
+                 now_wpm,
+                 acc,
+                 sb->errors,
+                 (int)secs / 60,
+                 (int)secs % 60);
+  if (race.fd >= 0 && race.board_race == race.race && race.board.rank > 0) {
+    (void)printw("  #%u of %u", race.board.rank, race.board.racers);
+  }
+}
+
+double
+live_wpm(const struct session_bufs* sb,
+         const struct text_metrics* m,
+         uint64_t now)
+{
+  double secs, per_char;
+
+  if (sb->log.len == 0 || now <= sb->log.first_ns || m->chars == 0) {
+    return 0.0;
+  }
+  /* As calc_speed: words are the non-space share of the characters. */
+  per_char = (double)m->non_space / (double)m->chars / m->avg_word_len * 60.0;
+  secs = (double)(now - sb->log.first_ns) / 1e9;
+  return (double)sb->correct * per_char / secs;
+}
+
+int
+session_begin(struct session_bufs* sb, const char* text, size_t total_chars)
+{
+  struct glyph_table* g = &sb->glyphs;
+  size_t cap = total_chars + 1;
+  uint32_t* block;
+
+  /* (Re)size the buffer for user's input, which shares one block with the
+   * three arrays of the glyph table. */
+  if (sb->typed_cap < cap) {
+    block = realloc(sb->typed, 4 * cap * sizeof(*block));
+    if (!block) {
+      return -1;
+    }
+    sb->typed = block;
+    sb->typed_cap = cap;
+  }
+  cap = sb->typed_cap;
+  g->cp = sb->typed + cap;
+  g->off = g->cp + cap;
+  g->col = g->off + cap;
+  g->cap = (uint32_t)(cap - 1);
+  memset(sb->typed, 0, (total_chars + 1) * sizeof(*sb->typed));
+  if (key_log_reset(&sb->log, total_chars) != 0) {
     return -1;
   }
+  glyphs_build(g, text, total_chars);
+  sb->cur = 0;
+  sb->total = g->n;
+  sb->base = 0;
+  sb->correct = 0;
+  sb->errors = 0;
+  sb->roll_len = 0;
+  sb->roll_pos = 0;
+  memset(&sb->keys, 0, sizeof(sb->keys));
+  return 0;
+}
+
+int
+session_key(struct session_bufs* sb, uint64_t t_ns, int ch)
+{
+  if (ch == RECORD_BACKSPACE || ch == 8) {
+    key_log_add(&sb->log, t_ns, sb->cur, ch);
+    if (sb->cur > 0) {
+      sb->cur--;
+      if (sb->typed[sb->cur] == sb->glyphs.cp[sb->cur])
+        sb->correct--;
+    }
+  } else if (sb->cur >= sb->total) {
+    /* Nothing is typed past the end of the text. */
+    return 1;
+  } else if (ch >= 0 && key_printable((uint32_t)ch)) { /* Printable chars */
+    key_stats_add(&sb->keys,
+                  &sb->glyphs,
+                  sb->cur,
+                  (uint32_t)ch,
+                  sb->log.len + sb->log.dropped > 0 ? t_ns - sb->log.last_ns
+                                                    : 0);
+    key_log_add(&sb->log, t_ns, sb->cur, ch);
+    sb->typed[sb->cur] = (uint32_t)ch;
+    if ((uint32_t)ch == sb->glyphs.cp[sb->cur])
+      sb->correct++;
+    else
+      sb->errors++;
+    sb->cur++;
+  } else {
+    return sb->cur >= sb->total;
+  }
+
+  sb->roll[sb->roll_pos].t_ns = t_ns;
+  sb->roll[sb->roll_pos].cur = sb->cur;
+  sb->roll_pos = (sb->roll_pos + 1) % ROLL_KEYS;
+  if (sb->roll_len < ROLL_KEYS)
+    sb->roll_len++;
+  return sb->cur >= sb->total;
+}
+
+void
+session_score(struct session_bufs* sb,
+              const struct text_metrics* m,
+              struct session_result* r)
+{
+  double elapsed;
+  size_t typed;
 
-  free(tmp);
-  return 0;
+  r->cpm = 0.0;
+  r->wpm = 0.0;
+  elapsed = key_log_elapsed(&sb->log);
+  if (elapsed <= 0)
+    elapsed = 1; /* avoid division by zero */
+  calc_speed(m, elapsed, &r->wpm, &r->cpm);
+
+  typed = sb->base + sb->cur;
+  r->accuracy = typed ? ((double)sb->correct * 100.0) / (double)typed : 100.0;
+  latency_stats_compute(&sb->lat, &sb->log);
+  r->consistency = sb->lat.consistency;
 }
 
 int
-create_data_csv(void)
+read_key(void)
 {
+  wint_t wc;
 
-  static char path[PATH_MAX]; /* path to the data.csv file */
-  char* dir_path;             /* path to data.csv file without file name */
-  char* last_slash;
-  FILE* file;
-
-  home_dir = getenv("HOME");
-  if (home_dir == NULL) {
-    fprintf(stderr, "Error: HOME environment variable is not set.\n");
-    return -1;
+  switch (get_wch(&wc)) {
+    case OK:
+      return (int)wc;
+    case KEY_CODE_YES:
+      return wc == KEY_BACKSPACE ? RECORD_BACKSPACE : KEY_FN((int)wc);
+    default:
+      return ERR;
   }
+}
 
-  /* construct path */
-  snprintf(path, sizeof(path), "%s/%s", home_dir, scores_file);
-  scores_file = path;
+int
+wait_results(int last)
+{
+  int ch;
 
-  dir_path = strdup(path);
-  if (dir_path == NULL) {
-    perror("strdup");
-    return -1;
-  }
+  (void)mvprintw(5,
+                 5,
+                 last ? "[[ Press any key ]]"
+                      : "[[ Press any key for the next text, q to quit ]]");
+  (void)refresh();
+  while ((ch = getch()) == KEY_RESIZE)
+    ;
+  return ch;
+}
 
-  last_slash = strrchr(dir_path, '/');
-  if (last_slash != NULL) {
-    *last_slash = '\0';
-  }
+void
+session_bufs_free(struct session_bufs* sb)
+{
+  free(sb->typed);
+  free(sb->log.ev);
+  free(sb->rs.layout.starts);
+  memset(sb, 0, sizeof(*sb));
+}
 
-  if (__create_directories(dir_path) != 0) {
-    free(dir_path);
-    return -1;
-  }
-  free(dir_path);
+void*
+arena_alloc(struct arena* a, size_t n)
+{
+  struct arena_block* b = a->head;
+  size_t size;
+  void* p;
 
-  file = fopen(path, "a");
-  if (file == NULL) {
-    perror("fopen");
-    return -1;
+  n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (b == NULL || b->size - b->used < n) {
+    size = b ? b->size * 2 : ARENA_BLOCK;
+    if (size < n) {
+      size = n;
+    }
+    b = malloc(ARENA_HDR + size);
+    if (!b) {
+      perror("malloc");
+      return NULL;
+    }
+    b->prev = a->head;
+    b->size = size;
+    b->used = 0;
+    a->head = b;
   }
-  fclose(file);
 
-  if (debug == 1) {
-    fprintf(stderr, "[debug] File created or already exists: %s\n", path);
+  p = (unsigned char*)b + ARENA_HDR + b->used;
+  b->used += n;
+  a->live += n;
+  if (a->live > a->peak) {
+    a->peak = a->live;
   }
-  return 0;
+  return p;
 }
 
 char*
-read_file(const char* path)
+arena_strdup(struct arena* a, const char* s)
 {
-  char* buffer = NULL; /* file buffer */
-  long length;         /* file length */
-  FILE* f = fopen(path, "rb");
-
-  if (!f) {
-    if (debug) {
-      fprintf(stderr, "Error reading %s\n", path);
-    }
-    perror("fopen");
-    return NULL;
-  }
+  size_t len = strlen(s) + 1;
+  char* p = arena_alloc(a, len);
 
-  if (fseek(f, 0, SEEK_END) != 0) {
-    perror("Error seeking EOF");
-    fclose(f);
-    return NULL;
+  if (p) {
+    memcpy(p, s, len);
   }
+  return p;
+}
 
-  length = ftell(f);
-  if (length < 0) {
-    perror("Error getting file length");
-    fclose(f);
-    return NULL;
-  }
+struct arena_mark
+arena_save(const struct arena* a)
+{
+  struct arena_mark m;
 
-  if (fseek(f, 0, SEEK_SET) != 0) {
-    perror("Error seeking to start of file");
-    fclose(f);
-    return NULL;
-  }
+  m.block = a->head;
+  m.used = a->head ? a->head->used : 0;
+  m.live = a->live;
+  return m;
+}
 
-  /* Allocate extra byte for null terminator */
-  buffer = malloc((size_t)length + 1);
-  if (!buffer) {
-    perror("Error allocating buffer");
-    fclose(f);
-    return NULL;
-  }
+void
+arena_release(struct arena* a, const struct arena_mark* m)
+{
+  struct arena_block* prev;
 
-  if (fread(buffer, 1, (size_t)length, f) != (size_t)length) {
-    perror("Error reading file");
-    free(buffer);
-    fclose(f);
-    return NULL;
+  while (a->head != m->block) {
+    prev = a->head->prev;
+    free(a->head);
+    a->head = prev;
   }
-  buffer[length] = '\0';
-
-  if (fclose(f) != 0) {
-    perror("Error closing file");
-    free(buffer);
-    return NULL;
+  if (a->head) {
+    a->head->used = m->used;
   }
-
-  return buffer;
+  a->live = m->live;
 }
 
-double
-average_word_length(const char* s)
+void
+arena_reset(struct arena* a)
 {
-  size_t total_length = 0;
-  size_t word_count = 0;
-  int in_word = 0;
-
-  if (s == NULL) {
-    return DEF_AVG_WORDLEN;
-  }
+  size_t peak = a->peak;
 
-  while (*s) {
-    if (isspace((unsigned char)*s)) {
-      if (in_word) {
-        word_count++;
-        in_word = 0;
-      }
-    } else {
-      total_length++;
-      in_word = 1;
+  /* A single block is kept; if the round needed more, the blocks are
+   * replaced by one that holds all of it. */
+  if (a->head && a->head->prev) {
+    arena_free(a);
+    a->head = malloc(ARENA_HDR + peak);
+    if (a->head) {
+      a->head->prev = NULL;
+      a->head->size = peak;
     }
-    s++;
   }
-
-  if (in_word) {
-    word_count++;
+  if (a->head) {
+    a->head->used = 0;
   }
-
-  return word_count ? ((double)total_length / word_count) : 0.0;
+  a->live = 0;
+  a->peak = 0;
 }
 
 void
-calc_speed(const char* filename, double elapsed, double* wpm, double* cpm)
+arena_free(struct arena* a)
 {
-  int ch;
-  FILE* file = fopen(filename, "r");
-  int total_chars = 0;
+  struct arena_mark none;
 
-  if (!file) {
-    perror("Error opening file");
-    exit(EXIT_FAILURE);
-  }
+  memset(&none, 0, sizeof(none));
+  arena_release(a, &none);
+  a->peak = 0;
+}
 
-  /* Count only non-whitespace characters */
-  while ((ch = fgetc(file)) != EOF) {
-    if (!isspace(ch)) {
-      total_chars++;
-    }
-  }
-  fclose(file);
+uint64_t
+now_ns(void)
+{
+  struct timespec ts;
 
-  *cpm = ((double)total_chars / elapsed) * 60.0;
-  *wpm = *cpm / average_word_length(read_file(filename));
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
-char*
-select_random_file(void)
+int
+trace_open(void)
 {
-  struct dirent* dent;
-  DIR* dir;
-  char* selected_file = NULL;
-  int count = 0;
-
-  if ((dir = opendir(ENTRIES_DIR)) == NULL) {
-    perror("opendir");
-    return NULL;
+  trace_ring = malloc(TRACE_CAP * sizeof(*trace_ring));
+  if (!trace_ring) {
+    perror("malloc");
+    return -1;
   }
+  (void)atexit(trace_dump);
+  return 0;
+}
 
-  while ((dent = readdir(dir)) != NULL) {
-    if ((unsigned char)dent->d_type != (unsigned char)REGULAR_FILE)
-      continue;
+uint64_t
+trace_begin(void)
+{
+  return trace_ring ? now_ns() : 0;
+}
 
-    count++;
-    /* Replace the current selection with probability 1/count */
-    if (rand() % count == 0) {
-      free(selected_file);
-      selected_file = strdup(dent->d_name);
-      if (!selected_file) {
-        perror("strdup");
-        closedir(dir);
-        return NULL;
-      }
-    }
+void
+trace_end(const char* name, uint64_t start)
+{
+  if (trace_ring) {
+    trace_add(name, 1, start, now_ns());
   }
-
-  closedir(dir);
-  free(dent);
-  return selected_file;
 }
 
 void
-seed_rng(void)
+trace_add(const char* name, int tid, uint64_t start, uint64_t end)
 {
-  srand((unsigned int)time(NULL));
+  struct trace_span* s;
+
+  if (!trace_ring) {
+    return;
+  }
+  s = &trace_ring[trace_len++ % TRACE_CAP];
+  s->name = name;
+  s->tid = tid;
+  s->start_ns = start;
+  s->dur_ns = end - start;
 }
 
 void
-save_score(double wpm,
-           double cpm,
-           double accuracy,
-           double consistency,
-           char* path)
+trace_dump(void)
 {
+  const struct trace_span* s;
+  uint64_t i, first;
   FILE* fp;
 
-  if (create_data_csv() != 0) {
-    fprintf(
-      stderr, "Failed to create data csv path %s/%s", home_dir, scores_file);
-    if (path != NULL) {
-      free(path);
+  first = trace_len > TRACE_CAP ? trace_len - TRACE_CAP : 0;
+  fp = fopen(trace_path, "w");
+  if (fp == NULL) {
+    perror("fopen trace");
+    return;
+  }
+  fprintf(fp, "{\"traceEvents\":[");
+  for (i = first; i < trace_len; i++) {
+    s = &trace_ring[i % TRACE_CAP];
+    fprintf(fp,
+            "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%ld,\"tid\":%d}",
+            i > first ? "," : "",
+            s->name,
+            (double)s->start_ns / 1000.0,
+            (double)s->dur_ns / 1000.0,
+            (long)getpid(),
+            s->tid);
+  }
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  if (fclose(fp) != 0) {
+    perror("fclose trace");
+  }
+  free(trace_ring);
+  trace_ring = NULL;
+}
+
+int
+key_log_reset(struct key_log* log, size_t total_chars)
+{
+  /* Room for every character plus a generous number of corrections. */
+  size_t need = total_chars * 2 + 64;
+  struct key_event* ev;
+
+  if (log->cap < need) {
+    ev = realloc(log->ev, need * sizeof(*log->ev));
+    if (!ev) {
+      return -1;
     }
-    exit(EXIT_FAILURE);
+    log->ev = ev;
+    log->cap = need;
   }
+  log->len = 0;
+  log->dropped = 0;
+  log->first_ns = 0;
+  log->last_ns = 0;
+  return 0;
+}
 
-  fp = fopen(scores_file, "a");
-  if (!fp) {
-    perror("fopen scores file");
+void
+key_log_add(struct key_log* log, uint64_t t_ns, size_t index, int ch)
+{
+  if (log->len == 0 && log->dropped == 0) {
+    log->first_ns = t_ns;
+  }
+  log->last_ns = t_ns;
+
+  if (log->len == log->cap) {
+    log->dropped++;
     return;
   }
+  log->ev[log->len].t_ns = t_ns;
+  log->ev[log->len].index = (uint32_t)index;
+  log->ev[log->len].ch = (int32_t)ch;
+  log->len++;
+}
 
-  /* Save score in CSV format: WPM,CPM,Accuracy,Consistency,Path */
-  fprintf(
-    fp, "%.2f,%.2f,%.2f,%.2f,%s\n", wpm, cpm, accuracy, consistency, path);
-  fclose(fp);
+double
+key_log_elapsed(const struct key_log* log)
+{
+  return (double)(log->last_ns - log->first_ns) / 1e9;
 }
 
-void
-draw_scrolled(const char* text,
-              int total_chars,
-              size_t i,
-              int screen_width,
-              char* typed,
-              int current_index)
+int
+latency_bucket(uint64_t us)
 {
-  /* Original horizontal scrolling mode */
-  int offset = (current_index + char_offset < screen_width)
-                 ? 0
-                 : current_index - screen_width + char_offset + 1;
+  int e = 0, b;
 
-  for (i = offset; (int)i < current_index; i++) {
-    if ((int)i >= total_chars)
-      break;
-    if (typed[i] == text[i]) {
-      (void)attron(COLOR_PAIR(1));
-      (void)mvaddch(0, i - offset, (chtype)typed[i]);
-      (void)attroff(COLOR_PAIR(1));
-    } else {
-      (void)attron(COLOR_PAIR(3));
-      (void)mvaddch(
-        0, i - offset, HIDE_ERR ? (chtype)text[i] : (chtype)typed[i]);
-      (void)attroff(COLOR_PAIR(3));
-    }
+  if (us < ((uint64_t)1 << LAT_MIN_SHIFT)) {
+    return 0;
   }
+  while ((us >> e) > 1) {
+    e++;
+  }
+  /* e = floor(log2(us)); the next LAT_SUB_BITS bits pick the sub-bucket. */
+  b = 1 + ((e - LAT_MIN_SHIFT) << LAT_SUB_BITS) +
+      (int)((us >> (e - LAT_SUB_BITS)) & ((1u << LAT_SUB_BITS) - 1));
+  return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
 
-  (void)attron(COLOR_PAIR(2));
-  (void)attron(A_DIM);
-  (void)mvprintw(0,
-                 current_index - offset,
-                 "%.*s",
-                 screen_width - (current_index - offset),
-                 text + current_index);
-  (void)attroff(A_DIM);
-  (void)attroff(COLOR_PAIR(2));
+/* latency_bucket_ms - Midpoint of a histogram bucket, in milliseconds. */
+static double
+latency_bucket_ms(int b)
+{
+  int e, sub;
+  double lo, width;
+
+  if (b == 0) {
+    return (double)((uint64_t)1 << LAT_MIN_SHIFT) / 2000.0;
+  }
+  e = (b - 1) / (1 << LAT_SUB_BITS) + LAT_MIN_SHIFT;
+  sub = (b - 1) % (1 << LAT_SUB_BITS);
+  width = (double)((uint64_t)1 << (e - LAT_SUB_BITS));
+  lo = (double)((uint64_t)1 << e) + sub * width;
+  return (lo + width / 2.0) / 1000.0;
 }
 
-void
-draw_wrapped(const char* text,
-             int total_chars,
-             int screen_width,
-             char* typed,
-             int current_index)
+/* latency_percentile - Approximate percentile from the histogram. */
+static double
+latency_percentile(const struct latency_stats* lat, double p)
 {
-  int i;
-  int row, col;
-
-  /* In wrap mode, use fixed width wrapping */
-  for (i = 0; i < total_chars; i++) {
-    row = i / screen_width;
-    col = i % screen_width;
-    if (i < current_index) {
-      if (typed[i] == text[i]) {
-        (void)attron(COLOR_PAIR(1));
-        (void)mvaddch(row, col, (chtype)typed[i]);
-        (void)attroff(COLOR_PAIR(1));
-      } else {
-        (void)attron(COLOR_PAIR(3));
-        /* If HIDE_ERR is 1, show expected char */
-        (void)mvaddch(row, col, HIDE_ERR ? (chtype)text[i] : (chtype)typed[i]);
-        (void)attroff(COLOR_PAIR(3));
-      }
-    } else {
-      (void)attron(COLOR_PAIR(2));
-      (void)attron(A_DIM);
-      (void)mvaddch(row, col, (chtype)text[i]);
-      (void)attroff(A_DIM);
-      (void)attroff(COLOR_PAIR(2));
+  size_t rank, seen = 0;
+  int b;
+
+  if (lat->n == 0) {
+    return 0.0;
+  }
+  rank = (size_t)(p * (double)(lat->n - 1)) + 1;
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    seen += lat->hist[b];
+    if (seen >= rank) {
+      return latency_bucket_ms(b);
     }
   }
+  return latency_bucket_ms(LAT_BUCKETS - 1);
 }
 
 void
-run_typing_trainer(char* path, const char* text)
+latency_stats_compute(struct latency_stats* lat, const struct key_log* log)
 {
-  size_t total_chars;
-  size_t current_index;
-  int ch;
-  time_t start_time, end_time;
-  int started;
-  int screen_width;
-  size_t i;
-  char* typed;
-  int total_keystrokes;
-  int error_count;
-  double elapsed;
-  double wpm, cpm, accuracy, consistency;
-  size_t correct_chars;
+  const struct key_event *prev, *cur;
+  uint64_t us;
+  double delta, cv, mean;
+  size_t k, b;
+  int s, j;
 
-  /* Allocate buffer for user's input */
-  total_chars = strlen(text);
-  typed = malloc(total_chars + 1);
-  if (!typed)
-    return;
-  if (!memset(typed, 0, total_chars + 1)) {
-    perror("memset:");
-    free(typed);
-    exit(EXIT_FAILURE);
-  };
+  memset(lat, 0, sizeof(*lat));
 
-  /* Counters for keystrokes and errors for consistency */
-  total_keystrokes = 0;
-  error_count = 0;
+  for (k = 1; k < log->len; k++) {
+    prev = &log->ev[k - 1];
+    cur = &log->ev[k];
+    us = (cur->t_ns - prev->t_ns) / 1000;
 
-  __init_ncurses();
+    lat->hist[latency_bucket(us)]++;
+    lat->n++;
+    delta = (double)us - lat->mean_us;
+    lat->mean_us += delta / (double)lat->n;
+    lat->m2 += delta * ((double)us - lat->mean_us);
 
-  i = 0;
-  started = 0;
-  end_time = 0;
-  start_time = 0;
-  current_index = 0;
+    if (prev->ch >= PRINT_CHAR_MIN && prev->ch <= PRINT_CHAR_MAX &&
+        cur->ch >= PRINT_CHAR_MIN && cur->ch <= PRINT_CHAR_MAX) {
+      b = (size_t)(prev->ch - PRINT_CHAR_MIN) * BIGRAM_CHARS +
+          (size_t)(cur->ch - PRINT_CHAR_MIN);
+      lat->bigram_us[b] += us;
+      lat->bigram_n[b]++;
+    }
+  }
 
-  /* Typing loop */
-  while (current_index < total_chars) {
-    (void)clear();
-    screen_width = getmaxx(stdscr);
+  /* A perfectly even rhythm (cv = 0) scores 100%. */
+  lat->consistency = 100.0;
+  if (lat->n > 1 && lat->mean_us > 0.0) {
+    cv = sqrt(lat->m2 / (double)(lat->n - 1)) / lat->mean_us;
+    lat->consistency = cv < 1.0 ? 100.0 * (1.0 - cv) : 0.0;
+  }
+  lat->p50_ms = latency_percentile(lat, 0.50);
+  lat->p95_ms = latency_percentile(lat, 0.95);
+  lat->p99_ms = latency_percentile(lat, 0.99);
 
-    if (wrap_mode == 1) {
-      draw_wrapped(
-        text, (int)total_chars, screen_width, typed, (int)current_index);
-    } else {
-      draw_scrolled(
-        text, (int)total_chars, i, screen_width, typed, (int)current_index);
+  /* Keep the SLOW_BIGRAMS highest means, sorted slowest first. */
+  for (b = 0; b < BIGRAM_CHARS * BIGRAM_CHARS; b++) {
+    if (lat->bigram_n[b] == 0) {
+      continue;
     }
+    mean = (double)lat->bigram_us[b] / lat->bigram_n[b] / 1000.0;
+    for (s = 0; s < lat->nslow && lat->slow[s].mean_ms >= mean; s++)
+      ;
+    if (s == SLOW_BIGRAMS) {
+      continue;
+    }
+    if (lat->nslow < SLOW_BIGRAMS) {
+      lat->nslow++;
+    }
+    for (j = lat->nslow - 1; j > s; j--) {
+      lat->slow[j] = lat->slow[j - 1];
+    }
+    lat->slow[s].pair[0] = (char)(b / BIGRAM_CHARS + PRINT_CHAR_MIN);
+    lat->slow[s].pair[1] = (char)(b % BIGRAM_CHARS + PRINT_CHAR_MIN);
+    lat->slow[s].pair[2] = '\0';
+    lat->slow[s].mean_ms = mean;
+  }
+}
 
-    (void)refresh();
-    ch = getch();
-    if (started == 0) {
-      start_time = time(NULL);
-      started = 1;
-    }
-    if (ch == KEY_BACKSPACE || ch == PRINT_CHAR_MAX + 1 || ch == 8) {
-      if (current_index > 0)
-        current_index--;
-    } else if (ch >= PRINT_CHAR_MIN &&
-               ch <= PRINT_CHAR_MAX) { /* Printable characters */
-      total_keystrokes++;
-      typed[current_index] = (char)ch;
-      if ((unsigned char)ch != (unsigned char)text[current_index])
-        error_count++;
-      current_index++;
-    }
-  }
-  end_time = time(NULL);
-
-  cpm = 0.0;
-  wpm = 0.0;
-  elapsed = difftime(end_time, start_time);
-  if (elapsed <= 0)
-    elapsed = 1; /* avoid division by zero */
-  calc_speed(path, elapsed, &wpm, &cpm);
+void
+key_stats_add(struct key_stats* s,
+              const struct glyph_table* g,
+              size_t i,
+              uint32_t ch,
+              uint64_t dt_ns)
+{
+  uint64_t us = dt_ns / 1000;
+  uint32_t want = g->cp[i], prev;
+  uint32_t miss = ch != want;
+  size_t k, b;
 
-  correct_chars = 0;
-  for (i = 0; i < total_chars; i++) {
-    if (typed[i] == text[i])
-      correct_chars++;
+  if (want < PRINT_CHAR_MIN || want > PRINT_CHAR_MAX) {
+    return;
   }
-  accuracy = ((double)correct_chars * 100.0) / total_chars;
-  consistency =
-    total_keystrokes > 0
-      ? ((double)(total_keystrokes - error_count) * 100.0 / total_keystrokes)
-      : 100.0;
+  us = us < KEY_STATS_MAX_US ? us : KEY_STATS_MAX_US;
+  k = want - PRINT_CHAR_MIN;
+  s->key_n[k]++;
+  s->key_err[k] += miss;
+  s->key_us[k] += us;
 
-  draw_results(wpm, cpm, accuracy, consistency);
-  save_score(wpm, cpm, accuracy, consistency, path);
-  free(typed);
+  prev = i > 0 ? g->cp[i - 1] : 0;
+  if (prev < PRINT_CHAR_MIN || prev > PRINT_CHAR_MAX) {
+    return;
+  }
+  b = (prev - PRINT_CHAR_MIN) * BIGRAM_CHARS + k;
+  s->bigram_n[b]++;
+  s->bigram_err[b] += miss;
+  s->bigram_us[b] += us;
 }
 
 void
 usage(char* progname)
 {
   if (progname != NULL) {
-    fprintf(stderr, "Usage: %s [--wrap] [--debug]\n", progname);
+    fprintf(stderr,
+            "Usage: %s [--wrap] [--debug] [--rounds N | --endless] "
+            "[--time SECONDS | --words N] "
+            "[--adaptive] [--heatmap] [--record FILE] [--build-corpus] "
+            "[--stats [FILE.csv]] [--replay FILE] [--batch DIR] "
+            "[--serve [SOCKET] | --join [SOCKET]] [--trace FILE]\n",
+            progname);
   }
   exit(EXIT_FAILURE);
 }
@@ -791,17 +6737,67 @@ usage(char* progname)
 void
 parse_args(int argc, char** argv)
 {
-  /* Allow zero or one argument: optional "--wrap" */
-  if (argc > 3) {
-    usage(argv[0]);
-    exit(EXIT_FAILURE);
-  }
+  char* end;
+  long n;
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--wrap") == 0) {
-      wrap_mode = 1;
+      render_frame = render_wrapped;
     } else if (strcmp(argv[i], "--debug") == 0) {
       debug = 1;
+    } else if (strcmp(argv[i], "--build-corpus") == 0) {
+      build_corpus_mode = 1;
+    } else if (strcmp(argv[i], "--heatmap") == 0) {
+      heatmap_mode = 1;
+    } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      errno = 0;
+      n = strtol(argv[++i], &end, 10);
+      if (errno != 0 || *end != '\0' || n < 0 || n > INT_MAX) {
+        usage(argv[0]);
+      }
+      rounds = (int)n;
+    } else if (strcmp(argv[i], "--endless") == 0) {
+      rounds = 0;
+    } else if ((strcmp(argv[i], "--time") == 0 ||
+                strcmp(argv[i], "--words") == 0) &&
+               i + 1 < argc) {
+      errno = 0;
+      n = strtol(argv[i + 1], &end, 10);
+      if (errno != 0 || *end != '\0' || n <= 0 || n > INT_MAX / 1000) {
+        usage(argv[0]);
+      }
+      if (argv[i][2] == 't') {
+        time_limit = (int)n;
+        word_limit = 0;
+      } else {
+        word_limit = (int)n;
+        time_limit = 0;
+      }
+      stream_mode = 1;
+      i++;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_dir = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 ||
+               strcmp(argv[i], "--join") == 0) {
+      const char** sock = argv[i][2] == 's' ? &serve_path : &join_path;
+
+      *sock = RACE_SOCKET;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        *sock = argv[++i];
+      }
+    } else if (strcmp(argv[i], "--adaptive") == 0) {
+      adaptive_mode = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats_mode = 1;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        stats_csv = argv[++i];
+      }
     } else {
       usage(argv[0]);
       exit(EXIT_FAILURE);
@@ -810,9 +6806,14 @@ parse_args(int argc, char** argv)
 }
 
 void
-draw_results(double wpm, double cpm, double accuracy, double consistency)
+draw_results(double wpm,
+             double cpm,
+             double accuracy,
+             double consistency,
+             const struct latency_stats* lat)
 {
   int acc_color_index = 0;
+  int k;
 
   (void)clear();
   (void)mvprintw(0, 0, "WPM: %.4f%% CPM: %.2f", wpm, cpm);
@@ -823,16 +6824,149 @@ draw_results(double wpm, double cpm, double accuracy, double consistency)
   (void)mvprintw(
     1, 0, "Accuracy: %.4f%% Consistency: %.2f%%", accuracy, consistency);
   (void)attroff(COLOR_PAIR(acc_color_index));
-  (void)mvprintw(4, 5, "[[ Press any key ]]");
+  (void)mvprintw(2,
+                 0,
+                 "Latency p50: %.0fms p95: %.0fms p99: %.0fms",
+                 lat->p50_ms,
+                 lat->p95_ms,
+                 lat->p99_ms);
+  if (lat->nslow > 0) {
+    (void)mvprintw(3, 0, "Slowest:");
+    for (k = 0; k < lat->nslow; k++) {
+      (void)printw(" '%s' %.0fms", lat->slow[k].pair, lat->slow[k].mean_ms);
+    }
+  }
+  /* The leaderboard of a race takes the rows below. */
+  if (heatmap_mode == 1 && race.fd < 0) {
+    draw_heatmap(7);
+  }
   (void)refresh();
-  (void)getch();
-  (void)endwin();
+}
+
+/* Keyboard rows of draw_heatmap, unshifted, and the columns they start at */
+static const char* const heat_rows[] = { "`1234567890-=",
+                                         "qwertyuiop[]\\",
+                                         "asdfghjkl;'",
+                                         "zxcvbnm,./" };
+static const int heat_indent[] = { 0, 6, 7, 9 };
+
+/* heat_shifted - The character typed with shift on the key of @c. */
+static int
+heat_shifted(int c)
+{
+  static const char plain[] = "`1234567890-=[]\\;',./";
+  static const char shifted[] = "~!@#$%^&*()_+{}|:\"<>?";
+  const char* p;
+
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 'A';
+  }
+  p = strchr(plain, c);
+  return p ? shifted[p - plain] : c;
+}
+
+/* heat_pair - Colour pair of a key missed @err times in @n attempts. */
+static int
+heat_pair(uint64_t n, uint64_t err)
+{
+  if (err * 50 < n) {
+    return 5;
+  }
+  return err * 20 < n ? 6 : 7;
+}
+
+/* heat_entry - A bigram ranked by draw_heatmap. */
+struct heat_entry
+{
+  double v;
+  size_t b;
+};
+
+/* heat_rank - Insert bigram @b with value @v into the @n entries of @top,
+ * highest first, keeping at most SLOW_BIGRAMS. */
+static void
+heat_rank(struct heat_entry* top, int* n, double v, size_t b)
+{
+  int k = *n < SLOW_BIGRAMS ? (*n)++ : SLOW_BIGRAMS - 1;
+
+  if (k == SLOW_BIGRAMS - 1 && *n == SLOW_BIGRAMS && top[k].v >= v) {
+    return;
+  }
+  for (; k > 0 && top[k - 1].v < v; k--) {
+    top[k] = top[k - 1];
+  }
+  top[k].v = v;
+  top[k].b = b;
+}
+
+void
+draw_heatmap(int row)
+{
+  const struct profile_file* p = key_profile;
+  struct heat_entry missed[SLOW_BIGRAMS], slow[SLOW_BIGRAMS];
+  int nmissed = 0, nslow = 0, r, i, k;
+  uint64_t n, err;
+  size_t b;
+  char c;
+
+  if (p == NULL) {
+    return;
+  }
+  for (r = 0; r < 4; r++) {
+    for (i = 0; (c = heat_rows[r][i]) != '\0'; i++) {
+      k = c - PRINT_CHAR_MIN;
+      n = p->key_n[k] + p->key_n[heat_shifted(c) - PRINT_CHAR_MIN];
+      err = p->key_err[k] + p->key_err[heat_shifted(c) - PRINT_CHAR_MIN];
+      (void)attrset(n ? COLOR_PAIR(heat_pair(n, err))
+                      : COLOR_PAIR(2) | A_DIM);
+      (void)mvprintw(row + r, heat_indent[r] + 4 * i, " %c ", c);
+    }
+  }
+  k = ' ' - PRINT_CHAR_MIN;
+  (void)attrset(p->key_n[k] ? COLOR_PAIR(heat_pair(p->key_n[k], p->key_err[k]))
+                            : COLOR_PAIR(2) | A_DIM);
+  (void)mvprintw(row + 4, 17, "%-19s", "        space");
+
+  (void)attrset(A_NORMAL);
+  (void)mvprintw(row + 5, 0, "Missed:");
+  for (k = 5; k <= 7; k++) {
+    (void)attrset(COLOR_PAIR(k));
+    (void)printw(" %s ", k == 5 ? "<2%" : k == 6 ? "<5%" : "5%+");
+    (void)attrset(A_NORMAL);
+    (void)printw(" ");
+  }
+  (void)printw(" over %llu sessions", (unsigned long long)p->sessions);
+
+  for (b = 0; b < BIGRAM_CHARS * BIGRAM_CHARS; b++) {
+    n = p->bigram_n[b];
+    if (n < HEATMAP_MIN_SAMPLES) {
+      continue;
+    }
+    if (p->bigram_err[b] > 0) {
+      heat_rank(missed, &nmissed, (double)p->bigram_err[b] / (double)n, b);
+    }
+    heat_rank(slow, &nslow, (double)p->bigram_us[b] / (double)n, b);
+  }
+  (void)mvprintw(row + 6, 0, "Most missed:");
+  for (k = 0; k < nmissed; k++) {
+    (void)printw(" '%c%c' %.1f%%",
+                 (int)(missed[k].b / BIGRAM_CHARS) + PRINT_CHAR_MIN,
+                 (int)(missed[k].b % BIGRAM_CHARS) + PRINT_CHAR_MIN,
+                 missed[k].v * 100.0);
+  }
+  (void)mvprintw(row + 7, 0, "Slowest:");
+  for (k = 0; k < nslow; k++) {
+    (void)printw(" '%c%c' %.0fms",
+                 (int)(slow[k].b / BIGRAM_CHARS) + PRINT_CHAR_MIN,
+                 (int)(slow[k].b % BIGRAM_CHARS) + PRINT_CHAR_MIN,
+                 slow[k].v / 1000.0);
+  }
 }
 
 void
 __init_ncurses(void)
 {
-  /* Initialize ncurses */
+  /* Initialize ncurses, in the locale main has set. */
   (void)initscr();
   (void)cbreak();
   (void)noecho();
@@ -849,5 +6983,61 @@ __init_ncurses(void)
     (void)init_pair(3, COLOR_RED, COLOR_BLACK);
     /* Color pair 4: green on black for good accuracy */
     (void)init_pair(4, COLOR_GREEN, COLOR_BLACK);
+    /* Color pairs 5 to 7: keys of the --heatmap, by how often they are
+     * missed */
+    (void)init_pair(5, COLOR_BLACK, COLOR_GREEN);
+    (void)init_pair(6, COLOR_BLACK, COLOR_YELLOW);
+    (void)init_pair(7, COLOR_BLACK, COLOR_RED);
+  }
+}
+
+/* Where stderr_hold keeps stderr, and the descriptor it was moved from */
+static FILE* stderr_held = NULL;
+static int stderr_saved = -1;
+
+void
+stderr_hold(void)
+{
+  static int registered = 0;
+
+  (void)fflush(stderr);
+  stderr_held = tmpfile();
+  if (stderr_held == NULL) {
+    return;
+  }
+  stderr_saved = dup(STDERR_FILENO);
+  if (stderr_saved < 0 || dup2(fileno(stderr_held), STDERR_FILENO) < 0) {
+    if (stderr_saved >= 0) {
+      close(stderr_saved);
+      stderr_saved = -1;
+    }
+    fclose(stderr_held);
+    stderr_held = NULL;
+    return;
+  }
+  if (!registered) {
+    registered = 1;
+    (void)atexit(stderr_release);
+  }
+}
+
+void
+stderr_release(void)
+{
+  char buf[4096];
+  size_t n;
+
+  if (stderr_held == NULL) {
+    return;
+  }
+  (void)fflush(stderr);
+  (void)dup2(stderr_saved, STDERR_FILENO);
+  close(stderr_saved);
+  stderr_saved = -1;
+  rewind(stderr_held);
+  while ((n = fread(buf, 1, sizeof(buf), stderr_held)) > 0) {
+    (void)fwrite(buf, 1, n, stderr);
   }
+  fclose(stderr_held);
+  stderr_held = NULL;
 }
@@ -0,0 +1,921 @@
+/*
+ * Typc - A console-based typing trainer
+ * Copyright (C) 2025 Joshua Rose <joshuarose@gmx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The race server of --serve, one epoll loop on one thread, and the client
+ * end of --join's connection. See race.h.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "race.h"
+
+/* The most clients a server takes */
+#define RACE_MAX_CLIENTS 1024
+
+/* Race timing: leaderboards go out at most every RACE_BOARD_NS, a race
+ * starts RACE_LOBBY_NS after its text is sent and is called off after
+ * RACE_LIMIT_NS, and the next one follows RACE_PAUSE_NS after the end. */
+#define RACE_BOARD_NS 5000000u
+#define RACE_LOBBY_NS 5000000000ull
+#define RACE_LIMIT_NS 300000000000ull
+#define RACE_PAUSE_NS 5000000000ull
+
+/**
+ * race_progress - Position of a racer, sent after every key.
+ * @cur: Cursor position.
+ * @errors: Wrong characters typed so far.
+ * @wpm10: Speed so far, in tenths of a WPM.
+ * @done: Non-zero once the whole text has been typed.
+ */
+struct race_progress
+{
+  uint32_t cur;
+  uint32_t errors;
+  uint32_t wpm10;
+  uint32_t done;
+};
+
+/**
+ * race_client - A client of race_serve.
+ * @fd: The socket, or -1 if the slot is free.
+ * @joined: The client has sent its name.
+ * @name: Name of the racer.
+ * @in: Bytes received but not handled yet; @in_len of them.
+ * @out: Bytes to send, from @out_off to @out_len.
+ * @want_out: Waiting for the socket to become writable.
+ * @race: Race the client takes part in, or 0.
+ * @cur: Characters typed in the race.
+ * @wpm10: Speed in tenths of a WPM.
+ * @place: Finishing place, or 0 while still typing.
+ * @rank: Rank on the last leaderboard.
+ */
+struct race_client
+{
+  int fd;
+  int joined;
+  char name[RACE_NAME_LEN];
+  unsigned char in[sizeof(struct race_msg) + RACE_NAME_LEN +
+                   sizeof(struct race_progress)];
+  size_t in_len;
+  unsigned char out[RACE_MSG_MAX * 2];
+  size_t out_off;
+  size_t out_len;
+  int want_out;
+  uint32_t race;
+  uint32_t cur;
+  uint32_t wpm10;
+  uint32_t place;
+  uint32_t rank;
+};
+
+/* race_rank - Sort key of a racer; larger keys rank higher. */
+struct race_rank
+{
+  uint64_t key;
+  uint32_t slot;
+};
+
+/* States of a race server */
+enum race_state
+{
+  RACE_IDLE,
+  RACE_LOBBY,
+  RACE_RUNNING,
+  RACE_OVER
+};
+
+/**
+ * race_server - State of race_serve.
+ * @lfd: The listening socket.
+ * @ep: The epoll instance.
+ * @clients: RACE_MAX_CLIENTS slots, indexed by their epoll data.
+ * @ranks: Scratch space for sorting the racers.
+ * @state: Where the current race is.
+ * @race: Number of the current race.
+ * @t_start: When the race starts (RACE_LOBBY, RACE_RUNNING) or when the
+ * next one opens (RACE_OVER).
+ * @t_board: When the last leaderboard was sent.
+ * @dirty: A racer moved since then.
+ * @racers: Clients in the race.
+ * @finished: Of those, the ones that have finished.
+ * @places: Places handed out in the race.
+ * @pick: Chooses the race texts, passed @pick_ctx.
+ * @text: The race text.
+ * @debug: Report racers joining and leaving.
+ */
+struct race_server
+{
+  int lfd;
+  int ep;
+  struct race_client* clients;
+  struct race_rank* ranks;
+  enum race_state state;
+  uint32_t race;
+  uint64_t t_start;
+  uint64_t t_board;
+  int dirty;
+  uint32_t racers;
+  uint32_t finished;
+  uint32_t places;
+  race_pick_fn* pick;
+  void* pick_ctx;
+  struct race_pick text;
+  int debug;
+};
+
+/* race_now - Time on the monotonic clock, in nanoseconds. */
+static uint64_t
+race_now(void)
+{
+  struct timespec ts;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Set by the SIGINT and SIGTERM handlers of race_serve */
+static volatile sig_atomic_t race_stop = 0;
+
+static void
+race_on_signal(int sig)
+{
+  (void)sig;
+  race_stop = 1;
+}
+
+/* race_nonblock - Make a descriptor non-blocking. */
+static int
+race_nonblock(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* race_addr - Fill in the address of a socket path. */
+static int
+race_addr(struct sockaddr_un* sa, const char* path)
+{
+  size_t len = strlen(path);
+
+  memset(sa, 0, sizeof(*sa));
+  if (len >= sizeof(sa->sun_path)) {
+    fprintf(stderr, "Error: socket path too long: %s\n", path);
+    return -1;
+  }
+  sa->sun_family = AF_UNIX;
+  memcpy(sa->sun_path, path, len + 1);
+  return 0;
+}
+
+/* race_listen - Bind the server socket, replacing one left behind. */
+static int
+race_listen(const char* path)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if (race_addr(&sa, path) != 0) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0) {
+    fprintf(stderr, "Error: a race server is already running on %s\n", path);
+    close(fd);
+    return -1;
+  }
+  if (errno == ECONNREFUSED) {
+    (void)unlink(path);
+  }
+  close(fd);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+      listen(fd, SOMAXCONN) != 0 || race_nonblock(fd) != 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  /* Racers are usually other users of the same host. */
+  (void)chmod(path, 0666);
+  return fd;
+}
+
+/* race_watch - Set the epoll events of a client. */
+static void
+race_watch(struct race_server* srv, uint32_t slot, int out)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+  ev.data.u32 = slot;
+  (void)epoll_ctl(srv->ep, EPOLL_CTL_MOD, srv->clients[slot].fd, &ev);
+  srv->clients[slot].want_out = out;
+}
+
+/* race_drop - Disconnect a client and take it out of the race. */
+static void
+race_drop(struct race_server* srv, uint32_t slot)
+{
+  struct race_client* c = &srv->clients[slot];
+
+  if (c->race != 0 && c->race == srv->race &&
+      (srv->state == RACE_LOBBY || srv->state == RACE_RUNNING)) {
+    srv->racers--;
+    if (c->place != 0) {
+      srv->finished--;
+    }
+    srv->dirty = 1;
+  }
+  close(c->fd);
+  c->fd = -1;
+  if (srv->debug) {
+    fprintf(stderr, "[debug] racer %.*s left\n", RACE_NAME_LEN, c->name);
+  }
+}
+
+/* race_flush - Send what is queued for a client; -1 if it must go. */
+static int
+race_flush(struct race_server* srv, uint32_t slot)
+{
+  struct race_client* c = &srv->clients[slot];
+  ssize_t n;
+
+  while (c->out_off < c->out_len) {
+    n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!c->want_out) {
+        race_watch(srv, slot, 1);
+      }
+      return 0;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    c->out_off += (size_t)n;
+  }
+  c->out_off = 0;
+  c->out_len = 0;
+  if (c->want_out) {
+    race_watch(srv, slot, 0);
+  }
+  return 0;
+}
+
+/* race_queue - Queue a message for a client; -1 if there is no room. */
+static int
+race_queue(struct race_client* c,
+           uint16_t type,
+           uint32_t race,
+           const void* a,
+           size_t alen,
+           const void* b,
+           size_t blen)
+{
+  struct race_msg hdr;
+
+  if (c->out_off > 0) {
+    memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+    c->out_len -= c->out_off;
+    c->out_off = 0;
+  }
+  if (sizeof(c->out) - c->out_len < sizeof(hdr) + alen + blen) {
+    return -1;
+  }
+  hdr.type = type;
+  hdr.len = (uint16_t)(alen + blen);
+  hdr.race = race;
+  memcpy(c->out + c->out_len, &hdr, sizeof(hdr));
+  memcpy(c->out + c->out_len + sizeof(hdr), a, alen);
+  if (blen > 0) {
+    memcpy(c->out + c->out_len + sizeof(hdr) + alen, b, blen);
+  }
+  c->out_len += sizeof(hdr) + alen + blen;
+  return 0;
+}
+
+/* race_enter - Put a client into the race in the lobby and send the text. */
+static void
+race_enter(struct race_server* srv, uint32_t slot, uint64_t now)
+{
+  static unsigned char payload[PATH_MAX + RACE_TEXT_MAX + 2];
+  struct race_client* c = &srv->clients[slot];
+  struct race_text rt;
+  size_t plen = strlen(srv->text.path);
+
+  memset(&rt, 0, sizeof(rt));
+  rt.start_ms = (uint32_t)((srv->t_start - now) / 1000000u);
+  rt.path_len = (uint32_t)plen;
+  rt.text_len = (uint32_t)srv->text.len;
+  rt.entry = srv->text.entry;
+  rt.corpus_mtime_sec = srv->text.corpus_mtime_sec;
+  rt.corpus_mtime_nsec = srv->text.corpus_mtime_nsec;
+  memcpy(payload, srv->text.path, plen + 1);
+  memcpy(payload + plen + 1, srv->text.text, rt.text_len + 1);
+
+  c->race = srv->race;
+  c->cur = 0;
+  c->wpm10 = 0;
+  c->place = 0;
+  srv->racers++;
+  if (race_queue(c,
+                 RACE_TEXT,
+                 srv->race,
+                 &rt,
+                 sizeof(rt),
+                 payload,
+                 plen + 1 + rt.text_len + 1) != 0 ||
+      race_flush(srv, slot) != 0) {
+    race_drop(srv, slot);
+  }
+}
+
+/* race_open_lobby - Pick a text and let every waiting client in. */
+static void
+race_open_lobby(struct race_server* srv, uint64_t now)
+{
+  uint32_t slot;
+  int tries;
+
+  for (tries = 0; tries < 16; tries++) {
+    if (srv->pick(srv->pick_ctx, &srv->text) != 0) {
+      srv->state = RACE_IDLE;
+      return;
+    }
+    if (srv->text.chars > 0 && srv->text.len <= RACE_TEXT_MAX &&
+        strlen(srv->text.path) < PATH_MAX) {
+      break;
+    }
+  }
+  if (tries == 16) {
+    fprintf(stderr, "Error: no text short enough for a race\n");
+    srv->state = RACE_IDLE;
+    return;
+  }
+
+  srv->race++;
+  srv->state = RACE_LOBBY;
+  srv->t_start = now + RACE_LOBBY_NS;
+  srv->racers = 0;
+  srv->finished = 0;
+  srv->places = 0;
+  for (slot = 0; slot < RACE_MAX_CLIENTS; slot++) {
+    if (srv->clients[slot].fd >= 0 && srv->clients[slot].joined) {
+      race_enter(srv, slot, now);
+    }
+  }
+  fprintf(stderr, "race %u: %s\n", srv->race, srv->text.path);
+}
+
+static int
+cmp_race_rank(const void* a, const void* b)
+{
+  const struct race_rank* x = a;
+  const struct race_rank* y = b;
+
+  return (x->key < y->key) - (x->key > y->key);
+}
+
+/* race_broadcast - Rank the racers and push the leaderboard to everyone. */
+static void
+race_broadcast(struct race_server* srv, int over)
+{
+  struct race_entry top[RACE_TOP];
+  struct race_board board;
+  struct race_client* c;
+  uint32_t slot, n = 0, i;
+
+  /* Finishers first by place, then everyone else by progress. */
+  for (slot = 0; slot < RACE_MAX_CLIENTS; slot++) {
+    c = &srv->clients[slot];
+    if (c->fd >= 0 && c->race == srv->race) {
+      srv->ranks[n].key =
+        c->place ? (UINT64_C(1) << 63) - c->place : (uint64_t)c->cur;
+      srv->ranks[n].slot = slot;
+      n++;
+    }
+  }
+  qsort(srv->ranks, n, sizeof(*srv->ranks), cmp_race_rank);
+
+  memset(top, 0, sizeof(top));
+  for (i = 0; i < n && i < RACE_TOP; i++) {
+    c = &srv->clients[srv->ranks[i].slot];
+    memcpy(top[i].name, c->name, RACE_NAME_LEN);
+    top[i].cur = c->cur;
+    top[i].total = (uint32_t)srv->text.chars;
+    top[i].wpm10 = c->wpm10;
+    top[i].place = c->place;
+  }
+  board.racers = (uint16_t)n;
+  board.n = (uint16_t)(n < RACE_TOP ? n : RACE_TOP);
+  board.over = (uint16_t)over;
+  for (i = 0; i < n; i++) {
+    srv->clients[srv->ranks[i].slot].rank = i + 1;
+  }
+
+  /* Everyone connected gets the board, racers with their own rank. A client
+   * that has not taken the last one yet skips this one, since the next
+   * supersedes it; the final board is always queued. */
+  for (slot = 0; slot < RACE_MAX_CLIENTS; slot++) {
+    c = &srv->clients[slot];
+    if (c->fd < 0 || !c->joined || (c->out_len > 0 && !over)) {
+      continue;
+    }
+    board.rank = (uint16_t)(c->race == srv->race ? c->rank : 0);
+    if (race_queue(c,
+                   RACE_BOARD,
+                   srv->race,
+                   &board,
+                   sizeof(board),
+                   top,
+                   board.n * sizeof(*top)) != 0 ||
+        race_flush(srv, slot) != 0) {
+      race_drop(srv, slot);
+    }
+  }
+  srv->dirty = 0;
+}
+
+/* race_handle - Handle one message from a client; -1 if it must go. */
+static int
+race_handle(struct race_server* srv,
+            uint32_t slot,
+            const struct race_msg* hdr,
+            const unsigned char* payload,
+            uint64_t now)
+{
+  struct race_client* c = &srv->clients[slot];
+  struct race_progress p;
+  int k;
+
+  if (hdr->type == RACE_JOIN && hdr->len == RACE_NAME_LEN && !c->joined) {
+    memcpy(c->name, payload, RACE_NAME_LEN);
+    c->name[RACE_NAME_LEN - 1] = '\0';
+    for (k = 0; c->name[k] != '\0'; k++) {
+      if (c->name[k] < ' ' || c->name[k] > '~') {
+        c->name[k] = '?';
+      }
+    }
+    c->joined = 1;
+    if (srv->debug) {
+      fprintf(stderr, "[debug] racer %s joined\n", c->name);
+    }
+    if (srv->state == RACE_LOBBY) {
+      race_enter(srv, slot, now);
+    } else if (srv->state == RACE_IDLE) {
+      race_open_lobby(srv, now);
+    }
+    return 0;
+  }
+
+  if (hdr->type == RACE_PROGRESS && hdr->len == sizeof(p) && c->joined) {
+    /* Late reports of a race that is over are of no interest. */
+    if (hdr->race != srv->race || c->race != srv->race ||
+        srv->state != RACE_RUNNING) {
+      return 0;
+    }
+    memcpy(&p, payload, sizeof(p));
+    c->cur = p.cur < srv->text.chars
+               ? p.cur
+               : (uint32_t)srv->text.chars;
+    c->wpm10 = p.wpm10;
+    if (p.done && c->place == 0) {
+      c->place = ++srv->places;
+      srv->finished++;
+    }
+    srv->dirty = 1;
+    return 0;
+  }
+  return -1;
+}
+
+/* race_read - Read and handle what a client sent; -1 if it must go. */
+static int
+race_read(struct race_server* srv, uint32_t slot, uint64_t now)
+{
+  struct race_client* c = &srv->clients[slot];
+  struct race_msg hdr;
+  size_t off;
+  ssize_t n;
+
+  for (;;) {
+    n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    c->in_len += (size_t)n;
+
+    for (off = 0; c->in_len - off >= sizeof(hdr);
+         off += sizeof(hdr) + hdr.len) {
+      memcpy(&hdr, c->in + off, sizeof(hdr));
+      if (hdr.len > sizeof(c->in) - sizeof(hdr)) {
+        return -1;
+      }
+      if (c->in_len - off < sizeof(hdr) + hdr.len) {
+        break;
+      }
+      if (race_handle(srv, slot, &hdr, c->in + off + sizeof(hdr), now) != 0 ||
+          c->fd < 0) {
+        return -1;
+      }
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+  }
+}
+
+/* race_accept - Take every pending connection. */
+static void
+race_accept(struct race_server* srv)
+{
+  struct epoll_event ev;
+  struct race_client* c;
+  uint32_t slot;
+  int fd;
+
+  while ((fd = accept(srv->lfd, NULL, NULL)) >= 0) {
+    for (slot = 0; slot < RACE_MAX_CLIENTS && srv->clients[slot].fd >= 0;
+         slot++)
+      ;
+    if (slot == RACE_MAX_CLIENTS || race_nonblock(fd) != 0) {
+      close(fd);
+      continue;
+    }
+    c = &srv->clients[slot];
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = slot;
+    if (epoll_ctl(srv->ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      perror("epoll_ctl");
+      close(fd);
+      c->fd = -1;
+    }
+  }
+}
+
+/* race_tick - Advance the race and push the leaderboard when it is due. */
+static void
+race_tick(struct race_server* srv, uint64_t now)
+{
+  uint32_t slot;
+
+  if (srv->state == RACE_LOBBY && now >= srv->t_start) {
+    srv->state = RACE_RUNNING;
+    srv->dirty = 1;
+  }
+  if (srv->state == RACE_RUNNING &&
+      (srv->racers == srv->finished || now - srv->t_start >= RACE_LIMIT_NS)) {
+    race_broadcast(srv, 1);
+    fprintf(stderr,
+            "race %u: %u of %u finished\n",
+            srv->race,
+            srv->finished,
+            srv->racers);
+    srv->state = RACE_OVER;
+    srv->t_start = now + RACE_PAUSE_NS;
+    return;
+  }
+  if (srv->state == RACE_RUNNING && srv->dirty &&
+      now - srv->t_board >= RACE_BOARD_NS) {
+    race_broadcast(srv, 0);
+    srv->t_board = now;
+  }
+  if (srv->state == RACE_OVER && now >= srv->t_start) {
+    srv->state = RACE_IDLE;
+    for (slot = 0; slot < RACE_MAX_CLIENTS; slot++) {
+      if (srv->clients[slot].fd >= 0 && srv->clients[slot].joined) {
+        race_open_lobby(srv, now);
+        break;
+      }
+    }
+  }
+}
+
+/* race_timeout - Milliseconds until race_tick has something to do. */
+static int
+race_timeout(const struct race_server* srv, uint64_t now)
+{
+  uint64_t due;
+
+  switch (srv->state) {
+    case RACE_LOBBY:
+    case RACE_OVER:
+      due = srv->t_start;
+      break;
+    case RACE_RUNNING:
+      due = srv->t_start + RACE_LIMIT_NS;
+      if (srv->dirty && srv->t_board + RACE_BOARD_NS < due) {
+        due = srv->t_board + RACE_BOARD_NS;
+      }
+      break;
+    default:
+      return -1;
+  }
+  return due > now ? (int)((due - now + 999999) / 1000000) : 0;
+}
+
+int
+race_serve(const char* path, race_pick_fn* pick, void* ctx, int debug)
+{
+  static struct epoll_event events[64];
+  struct race_server srv;
+  struct sigaction sa;
+  uint64_t now;
+  uint32_t slot;
+  int n, k, pending, ret = 0;
+
+  memset(&srv, 0, sizeof(srv));
+  srv.pick = pick;
+  srv.pick_ctx = ctx;
+  srv.debug = debug;
+  srv.clients = calloc(RACE_MAX_CLIENTS, sizeof(*srv.clients));
+  srv.ranks = calloc(RACE_MAX_CLIENTS, sizeof(*srv.ranks));
+  if (!srv.clients || !srv.ranks) {
+    perror("calloc");
+    ret = -1;
+    goto out;
+  }
+  for (slot = 0; slot < RACE_MAX_CLIENTS; slot++) {
+    srv.clients[slot].fd = -1;
+  }
+
+  srv.lfd = race_listen(path);
+  if (srv.lfd < 0) {
+    ret = -1;
+    goto out;
+  }
+  srv.ep = epoll_create1(EPOLL_CLOEXEC);
+  if (srv.ep < 0) {
+    perror("epoll_create1");
+    close(srv.lfd);
+    ret = -1;
+    goto out;
+  }
+  memset(&events[0], 0, sizeof(events[0]));
+  events[0].events = EPOLLIN;
+  events[0].data.u32 = RACE_MAX_CLIENTS;
+  (void)epoll_ctl(srv.ep, EPOLL_CTL_ADD, srv.lfd, &events[0]);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = race_on_signal;
+  (void)sigemptyset(&sa.sa_mask);
+  (void)sigaction(SIGINT, &sa, NULL);
+  (void)sigaction(SIGTERM, &sa, NULL);
+  fprintf(stderr, "Serving races on %s\n", path);
+
+  while (!race_stop) {
+    n = epoll_wait(srv.ep, events, 64, race_timeout(&srv, race_now()));
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      ret = -1;
+      break;
+    }
+    now = race_now();
+    pending = 0;
+    for (k = 0; k < n; k++) {
+      slot = events[k].data.u32;
+      if (slot == RACE_MAX_CLIENTS) {
+        pending = 1;
+        continue;
+      }
+      if (srv.clients[slot].fd < 0) {
+        continue;
+      }
+      if ((events[k].events & (EPOLLERR | EPOLLHUP)) ||
+          ((events[k].events & EPOLLOUT) && race_flush(&srv, slot) != 0) ||
+          ((events[k].events & EPOLLIN) && race_read(&srv, slot, now) != 0)) {
+        if (srv.clients[slot].fd >= 0) {
+          race_drop(&srv, slot);
+        }
+      }
+    }
+    /* Accept after the batch: a slot freed by race_drop may still have
+     * events of its old socket in it, which must not reach a new client. */
+    if (pending) {
+      race_accept(&srv);
+    }
+    race_tick(&srv, now);
+  }
+
+  for (slot = 0; slot < RACE_MAX_CLIENTS; slot++) {
+    if (srv.clients[slot].fd >= 0) {
+      close(srv.clients[slot].fd);
+    }
+  }
+  close(srv.ep);
+  close(srv.lfd);
+  (void)unlink(path);
+
+out:
+  free(srv.clients);
+  free(srv.ranks);
+  return ret;
+}
+
+int
+race_connect(struct race_conn* rc, const char* path)
+{
+  char name[RACE_NAME_LEN];
+  struct sockaddr_un sa;
+  struct race_msg hdr;
+  unsigned char msg[sizeof(hdr) + RACE_NAME_LEN];
+  const char* user = getenv("USER");
+  int fd;
+
+  if (race_addr(&sa, path) != 0) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+    fprintf(stderr,
+            "Error: cannot reach a race server on %s: %s\n",
+            path,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  memset(name, 0, sizeof(name));
+  snprintf(name, sizeof(name), "%s", user && *user ? user : "anonymous");
+  hdr.type = RACE_JOIN;
+  hdr.len = RACE_NAME_LEN;
+  hdr.race = 0;
+  memcpy(msg, &hdr, sizeof(hdr));
+  memcpy(msg + sizeof(hdr), name, RACE_NAME_LEN);
+  if (send(fd, msg, sizeof(msg), MSG_NOSIGNAL) != (ssize_t)sizeof(msg) ||
+      race_nonblock(fd) != 0) {
+    perror("send");
+    close(fd);
+    return -1;
+  }
+  rc->fd = fd;
+  rc->in_len = 0;
+  return 0;
+}
+
+int
+race_poll(struct race_conn* rc)
+{
+  struct race_text rt;
+  struct race_msg hdr;
+  const unsigned char* p;
+  size_t off;
+  ssize_t n;
+  int got = 0;
+
+  for (;;) {
+    n = recv(rc->fd, rc->in + rc->in_len, sizeof(rc->in) - rc->in_len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return got;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    rc->in_len += (size_t)n;
+
+    for (off = 0; rc->in_len - off >= sizeof(hdr);
+         off += sizeof(hdr) + hdr.len) {
+      memcpy(&hdr, rc->in + off, sizeof(hdr));
+      if (hdr.len > sizeof(rc->in) - sizeof(hdr)) {
+        return -1;
+      }
+      if (rc->in_len - off < sizeof(hdr) + hdr.len) {
+        break;
+      }
+      p = rc->in + off + sizeof(hdr);
+
+      if (hdr.type == RACE_TEXT && hdr.len >= sizeof(rt)) {
+        memcpy(&rt, p, sizeof(rt));
+        if (rt.path_len >= sizeof(rc->path) || rt.text_len > RACE_TEXT_MAX ||
+            sizeof(rt) + rt.path_len + 1 + rt.text_len + 1 != hdr.len) {
+          return -1;
+        }
+        memcpy(rc->path, p + sizeof(rt), rt.path_len);
+        rc->path[rt.path_len] = '\0';
+        memcpy(rc->text, p + sizeof(rt) + rt.path_len + 1, rt.text_len);
+        rc->text[rt.text_len] = '\0';
+        rc->race = hdr.race;
+        rc->info = rt;
+        rc->start_ns = race_now() + (uint64_t)rt.start_ms * 1000000u;
+        rc->have_text = 1;
+        got |= RACE_GOT_TEXT;
+      } else if (hdr.type == RACE_BOARD && hdr.len >= sizeof(rc->board)) {
+        memcpy(&rc->board, p, sizeof(rc->board));
+        if (rc->board.n > RACE_TOP ||
+            hdr.len != sizeof(rc->board) + rc->board.n * sizeof(*rc->top)) {
+          return -1;
+        }
+        memcpy(rc->top,
+               p + sizeof(rc->board),
+               rc->board.n * sizeof(*rc->top));
+        rc->board_race = hdr.race;
+        got |= RACE_GOT_BOARD;
+      }
+    }
+    memmove(rc->in, rc->in + off, rc->in_len - off);
+    rc->in_len -= off;
+  }
+}
+
+void
+race_report(struct race_conn* rc,
+            uint32_t cur,
+            uint32_t errors,
+            double wpm,
+            int done)
+{
+  unsigned char msg[sizeof(struct race_msg) + sizeof(struct race_progress)];
+  struct race_progress p;
+  struct race_msg hdr;
+  struct pollfd pfd;
+  size_t off = 0;
+  ssize_t n;
+
+  hdr.type = RACE_PROGRESS;
+  hdr.len = sizeof(p);
+  hdr.race = rc->race;
+  p.cur = cur;
+  p.errors = errors;
+  p.wpm10 = (uint32_t)(wpm * 10.0 + 0.5);
+  p.done = (uint32_t)done;
+  memcpy(msg, &hdr, sizeof(hdr));
+  memcpy(msg + sizeof(hdr), &p, sizeof(p));
+
+  /* A report that does not fit is superseded by the next one, but the last
+   * one of a round must get through. */
+  while (off < sizeof(msg)) {
+    n = send(rc->fd, msg + off, sizeof(msg) - off, MSG_NOSIGNAL);
+    if (n > 0) {
+      off += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        (off > 0 || done)) {
+      pfd.fd = rc->fd;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, 1000) > 0) {
+        continue;
+      }
+    }
+    return;
+  }
+}
@@ -0,0 +1,245 @@
+/*
+ * Typc - A console-based typing trainer
+ * Copyright (C) 2025 Joshua Rose <joshuarose@gmx.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Races of --serve and --join over a Unix socket: the wire protocol, the
+ * race server and the client end of a connection. Choosing texts and the
+ * screens of a race are left to main.c.
+ */
+
+#ifndef TYPC_RACE_H
+#define TYPC_RACE_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The default socket, the longest racer name and text, and the entries at
+ * the top of the leaderboard sent to every racer. */
+#define RACE_SOCKET "/tmp/typc-race.sock"
+#define RACE_NAME_LEN 16
+#define RACE_TEXT_MAX 4096
+#define RACE_TOP 5
+
+/* Clients check the socket at least every RACE_POLL_NS while typing. */
+#define RACE_POLL_NS 10000000u
+
+/* Largest protocol message: a race text and its path */
+#define RACE_MSG_MAX                                                           \
+  (sizeof(struct race_msg) + sizeof(struct race_text) + PATH_MAX +            \
+   RACE_TEXT_MAX + 2)
+
+/* What race_poll received */
+#define RACE_GOT_TEXT 1
+#define RACE_GOT_BOARD 2
+
+/**
+ * race_type - Messages of the race protocol.
+ * @RACE_JOIN: Client to server; the payload is the racer's name.
+ * @RACE_PROGRESS: Client to server, struct race_progress.
+ * @RACE_TEXT: Server to client, struct race_text plus path and text.
+ * @RACE_BOARD: Server to client, struct race_board plus entries.
+ */
+enum race_type
+{
+  RACE_JOIN = 1,
+  RACE_PROGRESS,
+  RACE_TEXT,
+  RACE_BOARD
+};
+
+/**
+ * race_msg - Header of a race protocol message.
+ * @type: One of enum race_type.
+ * @len: Bytes of payload following the header.
+ * @race: Number of the race the message belongs to.
+ *
+ * Client and server are on one host, so fields are in host byte order.
+ */
+struct race_msg
+{
+  uint16_t type;
+  uint16_t len;
+  uint32_t race;
+};
+
+/**
+ * race_text - The text of a race; @path_len + 1 bytes of path and
+ * @text_len + 1 bytes of text follow, both null-terminated.
+ * @start_ms: Time until the race starts.
+ * @entry: Index of the text in the server's corpus, or CORPUS_NONE.
+ * @corpus_mtime_sec: Source directory mtime recorded in the server's corpus,
+ * which tells a client whether its own mapping holds the same texts.
+ * @corpus_mtime_nsec: Nanoseconds of @corpus_mtime_sec.
+ */
+struct race_text
+{
+  uint32_t start_ms;
+  uint32_t path_len;
+  uint32_t text_len;
+  uint32_t entry;
+  int64_t corpus_mtime_sec;
+  int64_t corpus_mtime_nsec;
+};
+
+/**
+ * race_board - Leaderboard of a race; @n struct race_entry follow.
+ * @racers: Racers in the race.
+ * @rank: Rank of the receiving racer, or 0 if it is not in the race.
+ * @n: Entries that follow, the top of the board.
+ * @over: Non-zero once the race is over; the board is final.
+ */
+struct race_board
+{
+  uint16_t racers;
+  uint16_t rank;
+  uint16_t n;
+  uint16_t over;
+};
+
+/**
+ * race_entry - One racer on a leaderboard.
+ * @name: Name of the racer, null-terminated.
+ * @cur: Characters typed.
+ * @total: Length of the text.
+ * @wpm10: Speed in tenths of a WPM.
+ * @place: Finishing place, or 0 while still typing.
+ */
+struct race_entry
+{
+  char name[RACE_NAME_LEN];
+  uint32_t cur;
+  uint32_t total;
+  uint32_t wpm10;
+  uint32_t place;
+};
+
+/**
+ * race_conn - Connection of --join to a race server.
+ * @fd: The socket, or -1 when not racing.
+ * @in: Bytes received but not handled yet; @in_len of them.
+ * @race: Race of the last text received.
+ * @start_ns: When that race starts, on the monotonic clock.
+ * @have_text: A text arrived that no round has taken yet.
+ * @info: Header of that text.
+ * @path: Path of the text, as saved with the score.
+ * @text: The text.
+ * @board: The last leaderboard; @top holds its entries.
+ * @board_race: Race of @board, or 0 before the first one.
+ */
+struct race_conn
+{
+  int fd;
+  unsigned char in[RACE_MSG_MAX];
+  size_t in_len;
+  uint32_t race;
+  uint64_t start_ns;
+  int have_text;
+  struct race_text info;
+  char path[PATH_MAX];
+  char text[RACE_TEXT_MAX + 1];
+  struct race_board board;
+  struct race_entry top[RACE_TOP];
+  uint32_t board_race;
+};
+
+/**
+ * race_pick - The text of the next race, filled in by a race_pick_fn.
+ * @path: Path of the text, as sent to the racers.
+ * @text: The text, null-terminated.
+ * @len: Bytes of @text.
+ * @chars: Characters of @text, the length of the race.
+ * @entry: Index of the text in the corpus, or CORPUS_NONE.
+ * @corpus_mtime_sec: Source directory mtime recorded in the corpus, or 0.
+ * @corpus_mtime_nsec: Nanoseconds of @corpus_mtime_sec.
+ *
+ * @path and @text must stay valid until the next call.
+ */
+struct race_pick
+{
+  const char* path;
+  const char* text;
+  size_t len;
+  size_t chars;
+  uint32_t entry;
+  int64_t corpus_mtime_sec;
+  int64_t corpus_mtime_nsec;
+};
+
+/* race_pick_fn - Choose a text for race_serve; returns 0, or -1 if none. */
+typedef int
+race_pick_fn(void* ctx, struct race_pick* pick);
+
+/**
+ * race_serve - Run a race server (--serve).
+ * @path: Path of the Unix socket to listen on.
+ * @pick: Chooses the text of each race.
+ * @ctx: Passed to @pick.
+ * @debug: Report racers joining and leaving.
+ *
+ * The first racer to join opens the lobby; whoever joins within
+ * RACE_LOBBY_NS races too, later arrivals wait for the next race. Racers
+ * report their position after every key and get the leaderboard back,
+ * merged and pushed at most every RACE_BOARD_NS. A single epoll loop on one
+ * thread serves all clients, and no memory is allocated per message.
+ *
+ * Runs until SIGINT or SIGTERM. Returns 0 on a clean stop, -1 on failure.
+ */
+int
+race_serve(const char* path, race_pick_fn* pick, void* ctx, int debug);
+
+/**
+ * race_connect - Connect to a race server and introduce ourselves.
+ * @rc: The connection; @rc->fd is set on success.
+ * @path: Path of the server's Unix socket.
+ *
+ * The racer's name is taken from $USER.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+race_connect(struct race_conn* rc, const char* path);
+
+/**
+ * race_poll - Read whatever the race server has sent, without blocking.
+ * @rc: The connection.
+ *
+ * A new text or leaderboard replaces the previous one in @rc.
+ *
+ * Returns -1 if the connection was lost, otherwise a mask of RACE_GOT_TEXT
+ * and RACE_GOT_BOARD.
+ */
+int
+race_poll(struct race_conn* rc);
+
+/**
+ * race_report - Send the position of a racer to the race server.
+ * @rc: The connection.
+ * @cur: Cursor position.
+ * @errors: Wrong characters typed so far.
+ * @wpm: Speed so far.
+ * @done: Whether the text has been typed.
+ */
+void
+race_report(struct race_conn* rc,
+            uint32_t cur,
+            uint32_t errors,
+            double wpm,
+            int done);
+
+#endif /* TYPC_RACE_H */